@@ -1,6 +1,16 @@
-#include <list>
+#include <vector>
+#include <queue>
+#include <map>
 #include <iostream>
 #include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <string_view>
+#include <filesystem>
+#include <mutex>
+#include <condition_variable>
+#include "olcRealTimeSFX_DSP.h"
 using namespace std;
 
 #define FTYPE double
@@ -18,49 +28,56 @@ struct sKnob
 	FTYPE dStep;
 };
 
+// Low pass on the biquads in olcRealTimeSFX_DSP.h, in place of the old one
+// pole, which was fixed to 44100Hz. Cutoff changes glide over the next block.
+// Float only, like the biquads.
 struct sFilterLowPass
 {
-	FTYPE dAlpha;
-	FTYPE dPreviousSample; 
+	sfx::biquad filter;
+	double dSampleRate;
 
-	sFilterLowPass()
+	sFilterLowPass(double dSampleRate = 44100.0)
 	{
-		dAlpha = 0.0;
-		dPreviousSample = 0.0;
+		this->dSampleRate = dSampleRate;
 		SetCutOffFrequency(120.0);
+		filter.c = filter.target;
 	}
 
-	void SetCutOffFrequency(FTYPE dFrequency)
+	void SetCutOffFrequency(double dFrequency, double dQ = 0.7071)
 	{
-		dAlpha = exp(-2.0 * PI * dFrequency / 44100.0);
+		filter.set(sfx::design_biquad(sfx::FILTER_LOWPASS, dFrequency, dQ, dSampleRate));
 	}
 
-	FTYPE GetFiltered(FTYPE dTime, FTYPE dSample)
+	// Filters a block in place
+	void FilterBlock(float *pSamples, int nSamples)
 	{
-		FTYPE dOutput =  ((1.0 - dAlpha) * dSample) - (-dAlpha * dPreviousSample);
-		dPreviousSample = dOutput;
-		return dOutput;
+		filter.process(pSamples, pSamples, nSamples);
 	}
 };
 
 
+// The synth is templated on its sample type T. Samples, amplitudes and
+// envelopes are T, so hot paths can run in float; note times, frequencies and
+// phase accumulators stay double, where float would audibly drift. The voice
+// pool's SIMD lanes are the exception: they are float whatever T is.
 namespace synth
 {
 	//////////////////////////////////////////////////////////////////////////////
 	// Utilities
 
 	// Converts frequency (Hz) to angular velocity
-	FTYPE w(const FTYPE dHertz)
+	template<typename T>
+	T w(const T dHertz)
 	{
-		return dHertz * 2.0 * PI;
+		return dHertz * T(2.0 * PI);
 	}
 
 	// A basic note
 	struct note
 	{
 		int id;		// Position in scale
-		FTYPE on;	// Time note was activated
-		FTYPE off;	// Time note was deactivated
+		double on;	// Time note was activated
+		double off;	// Time note was deactivated
 		bool active;
 		int channel;
 
@@ -85,39 +102,40 @@ namespace synth
 	const int OSC_SAW_DIG = 4;
 	const int OSC_NOISE = 5;
 
-	FTYPE osc(const FTYPE dTime, const FTYPE dHertz, const int nType = OSC_SINE,
-		const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0, FTYPE dCustom = 50.0)
+	template<typename T = double>
+	T osc(const double dTime, const double dHertz, const int nType = OSC_SINE,
+		const double dLFOHertz = 0.0, const double dLFOAmplitude = 0.0, double dCustom = 50.0)
 	{
 
-		FTYPE dFreq = w(dHertz) * dTime + dLFOAmplitude * dHertz * (sin(w(dLFOHertz) * dTime));// osc(dTime, dLFOHertz, OSC_SINE);
+		double dFreq = w(dHertz) * dTime + dLFOAmplitude * dHertz * (sin(w(dLFOHertz) * dTime));// osc(dTime, dLFOHertz, OSC_SINE);
 
 		switch (nType)
 		{
 		case OSC_SINE: // Sine wave bewteen -1 and +1
-			return sin(dFreq);
+			return (T)sin(dFreq);
 
 		case OSC_SQUARE: // Square wave between -1 and +1
-			return sin(dFreq) > 0 ? 1.0 : -1.0;
+			return sin(dFreq) > 0 ? T(1) : T(-1);
 
 		case OSC_TRIANGLE: // Triangle wave between -1 and +1
-			return asin(sin(dFreq)) * (2.0 / PI);
+			return (T)(asin(sin(dFreq)) * (2.0 / PI));
 
 		case OSC_SAW_ANA: // Saw wave (analogue / warm / slow)
 		{
-			FTYPE dOutput = 0.0;
-			for (FTYPE n = 1.0; n < dCustom; n++)
-				dOutput += (sin(n*dFreq)) / n;
-			return dOutput * (2.0 / PI);
+			T dOutput = 0;
+			for (T n = 1; n < dCustom; n++)
+				dOutput += (T)sin(n*dFreq) / n;
+			return dOutput * T(2.0 / PI);
 		}
 
 		case OSC_SAW_DIG:
-			return (2.0 / PI) * (dHertz * PI * fmod(dTime, 1.0 / dHertz) - (PI / 2.0));
+			return (T)((2.0 / PI) * (dHertz * PI * fmod(dTime, 1.0 / dHertz) - (PI / 2.0)));
 
 		case OSC_NOISE:
-			return 2.0 * ((FTYPE)rand() / (FTYPE)RAND_MAX) - 1.0;
+			return T(2) * ((T)rand() / (T)RAND_MAX) - T(1);
 
 		default:
-			return 0.0;
+			return 0;
 		}
 	}
 
@@ -126,7 +144,7 @@ namespace synth
 
 	const int SCALE_DEFAULT = 0;
 
-	FTYPE scale(const int nNoteID, const int nScaleID = SCALE_DEFAULT)
+	double scale(const int nNoteID, const int nScaleID = SCALE_DEFAULT)
 	{
 		switch (nScaleID)
 		{
@@ -139,492 +157,2710 @@ namespace synth
 	//////////////////////////////////////////////////////////////////////////////
 	// Envelopes
 
+	// Stage curves for the incremental envelope
+	const int ENV_LINEAR = 0;
+	const int ENV_EXPONENTIAL = 1;
+
+	const int ENV_IDLE = 0;
+	const int ENV_ATTACK = 1;
+	const int ENV_DECAY = 2;
+	const int ENV_SUSTAIN = 3;
+	const int ENV_RELEASE = 4;
+
+	// Running state of an envelope for one voice. Every stage advances with
+	// dLevel = dLevel * dMul + dAdd, which covers both linear and exponential
+	// curves, and is snapped to dTarget when its sample count runs out.
+	template<typename T>
+	struct envelope_state
+	{
+		int nStage;
+		int nRemaining;	// Samples left in the current stage
+		T dLevel;
+		T dTarget;
+		T dMul;
+		T dAdd;
+
+		envelope_state()
+		{
+			nStage = ENV_IDLE;
+			nRemaining = 0;
+			dLevel = 0;
+			dTarget = 0;
+			dMul = 1;
+			dAdd = 0;
+		}
+	};
+
+	template<typename T>
 	struct envelope
 	{
-		virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff) = 0;
+		virtual T amplitude(const double dTime, const double dTimeOn, const double dTimeOff) = 0;
+	};
+
+	template<typename T>
+	struct envelope_adsr : public envelope<T>
+	{
+		double dAttackTime;
+		double dDecayTime;
+		T dSustainAmplitude;
+		double dReleaseTime;
+		T dStartAmplitude;
+		int nAttackCurve;
+		int nDecayCurve;
+		int nReleaseCurve;
+		double dCurveRatio;	// Overshoot of exponential stages, smaller is more curved
+
+		envelope_adsr()
+		{
+			dAttackTime = 0.1;
+			dDecayTime = 0.1;
+			dSustainAmplitude = 1.0;
+			dReleaseTime = 0.2;
+			dStartAmplitude = 1.0;
+			nAttackCurve = ENV_LINEAR;
+			nDecayCurve = ENV_LINEAR;
+			nReleaseCurve = ENV_LINEAR;
+			dCurveRatio = 0.01;
+		}
+
+		virtual T amplitude(const double dTime, const double dTimeOn, const double dTimeOff)
+		{
+			T dAmplitude = 0;
+			T dReleaseAmplitude = 0;
+
+			if (dTimeOn > dTimeOff) // Note is on
+			{
+				T dLifeTime = (T)(dTime - dTimeOn);
+
+				if (dLifeTime <= dAttackTime)
+					dAmplitude = (dLifeTime / (T)dAttackTime) * dStartAmplitude;
+
+				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
+					dAmplitude = ((dLifeTime - (T)dAttackTime) / (T)dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+
+				if (dLifeTime > (dAttackTime + dDecayTime))
+					dAmplitude = dSustainAmplitude;
+			}
+			else // Note is off
+			{
+				T dLifeTime = (T)(dTimeOff - dTimeOn);
+
+				if (dLifeTime <= dAttackTime)
+					dReleaseAmplitude = (dLifeTime / (T)dAttackTime) * dStartAmplitude;
+
+				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
+					dReleaseAmplitude = ((dLifeTime - (T)dAttackTime) / (T)dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+
+				if (dLifeTime > (dAttackTime + dDecayTime))
+					dReleaseAmplitude = dSustainAmplitude;
+
+				dAmplitude = ((T)(dTime - dTimeOff) / (T)dReleaseTime) * (T(0) - dReleaseAmplitude) + dReleaseAmplitude;
+			}
+
+			// Amplitude should not be negative
+			if (dAmplitude <= T(0))
+				dAmplitude = 0;
+
+			return dAmplitude;
+		}
+
+		// Start (or restart, from the current level) the attack stage
+		void trigger(envelope_state<T> &s, const double dTimeStep)
+		{
+			enter(s, ENV_ATTACK, dTimeStep);
+		}
+
+		// Fade from the current level to silence
+		void release(envelope_state<T> &s, const double dTimeStep)
+		{
+			if (s.nStage == ENV_IDLE || s.nStage == ENV_RELEASE)
+				return;
+			enter(s, ENV_RELEASE, dTimeStep);
+		}
+
+		// Writes nFrames of envelope into pOut. Returns how many of those frames
+		// were live; anything less than nFrames means the voice finished at
+		// exactly that sample and the rest of the block is silent.
+		int process(envelope_state<T> &s, T *pOut, const int nFrames, const double dTimeStep)
+		{
+			int n = 0;
+			while (n < nFrames)
+			{
+				if (s.nStage == ENV_IDLE)
+				{
+					int nLive = n;
+					for (; n < nFrames; n++)
+						pOut[n] = 0;
+					return nLive;
+				}
+
+				int nRun = min(nFrames - n, s.nRemaining);
+				T dLevel = s.dLevel;
+				const T dMul = s.dMul;
+				const T dAdd = s.dAdd;
+				for (int i = 0; i < nRun; i++)
+				{
+					dLevel = dLevel * dMul + dAdd;
+					pOut[n + i] = dLevel;
+				}
+
+				s.dLevel = dLevel;
+				s.nRemaining -= nRun;
+				n += nRun;
+
+				if (s.nRemaining == 0)
+					next(s, dTimeStep);
+			}
+			return nFrames;
+		}
+
+		// Snap to the target of a stage that has run its course and move on
+		void next(envelope_state<T> &s, const double dTimeStep)
+		{
+			s.dLevel = s.dTarget;
+			if (s.nStage == ENV_ATTACK) enter(s, ENV_DECAY, dTimeStep);
+			else if (s.nStage == ENV_DECAY) enter(s, ENV_SUSTAIN, dTimeStep);
+			else s.nStage = ENV_IDLE;
+		}
+
+	private:
+		// Precomputes the per-sample multiply-add that takes the current level
+		// to the stage target in the stage's length
+		void enter(envelope_state<T> &s, const int nStage, const double dTimeStep)
+		{
+			double dTime = 0.0;
+			int nCurve = ENV_LINEAR;
+			s.nStage = nStage;
+
+			switch (nStage)
+			{
+			case ENV_ATTACK:  dTime = dAttackTime;  s.dTarget = dStartAmplitude;   nCurve = nAttackCurve;  break;
+			case ENV_DECAY:   dTime = dDecayTime;   s.dTarget = dSustainAmplitude; nCurve = nDecayCurve;   break;
+			case ENV_RELEASE: dTime = dReleaseTime; s.dTarget = 0;                 nCurve = nReleaseCurve; break;
+			case ENV_SUSTAIN:
+				s.nRemaining = INT_MAX;
+				s.dMul = 1;
+				s.dAdd = 0;
+				return;
+			}
+
+			if (nStage == ENV_RELEASE && s.dLevel <= T(0))
+			{
+				s.nStage = ENV_IDLE;
+				s.dLevel = 0;
+				return;
+			}
+
+			s.nRemaining = max(1, (int)(dTime / dTimeStep + 0.5));
+
+			if (nCurve == ENV_EXPONENTIAL)
+			{
+				// Head for a target just past the real one, so the curve lands on it exactly
+				double dOvershoot = s.dTarget + dCurveRatio * (s.dTarget - s.dLevel);
+				double dMul = pow(dCurveRatio / (1.0 + dCurveRatio), 1.0 / s.nRemaining);
+				s.dMul = (T)dMul;
+				s.dAdd = (T)(dOvershoot * (1.0 - dMul));
+			}
+			else
+			{
+				s.dMul = 1;
+				s.dAdd = (s.dTarget - s.dLevel) / (T)s.nRemaining;
+			}
+		}
+	};
+
+	template<typename T>
+	T env(const double dTime, envelope<T> &env, const double dTimeOn, const double dTimeOff)
+	{
+		return env.amplitude(dTime, dTimeOn, dTimeOff);
+	}
+
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Voices
+
+	// Largest block an instrument will be asked to render in one call
+	const int BLOCK_FRAMES_MAX = 256;
+
+	template<typename T> struct instrument_base;
+
+	// A sounding note, plus the running state an instrument needs to render it
+	// block by block without re-deriving everything from the global time
+	template<typename T>
+	struct voice
+	{
+		int id;			// Position in scale
+		int channel;
+		bool active;
+		bool bReleased;
+		double dLife;		// Time since note was activated
+		envelope_state<T> env;
+		double dPhase[3];	// Oscillator phase accumulators
+		double dLFOPhase;
+		unsigned int nNoiseSeed;
+		unsigned int nSerial;	// Start order, for voice stealing
+		instrument_base<T> *pInstrument;
+
+		voice()
+		{
+			id = 0;
+			channel = 0;
+			active = false;
+			bReleased = false;
+			dLife = 0.0;
+			dPhase[0] = dPhase[1] = dPhase[2] = 0.0;
+			dLFOPhase = 0.0;
+			nNoiseSeed = 1;
+			nSerial = 0;
+			pInstrument = nullptr;
+		}
+	};
+
+	// Keeps a phase accumulator in [0, 2PI) so precision does not drain away on long notes
+	inline double wrap_phase(double dPhase)
+	{
+		return dPhase - 2.0 * PI * floor(dPhase / (2.0 * PI));
+	}
+
+	// Cheap per-voice white noise between -1 and +1
+	template<typename T>
+	inline T noise(unsigned int &nSeed)
+	{
+		nSeed = nSeed * 1664525u + 1013904223u;
+		return (T)(int)(nSeed >> 8) * T(2.0 / 16777216.0) - T(1);
+	}
+
+	// Square wave from a sine
+	template<typename T>
+	inline T sign(T dSine)
+	{
+		return dSine > T(0) ? T(1) : T(-1);
+	}
+
+
+	// Oscillator recipe that defines an instrument's sound. Each partial is a
+	// sine or square at a note offset; the LFO wobbles the first partial like
+	// osc() does, and noise is mixed in on top.
+	struct patch
+	{
+		int nNoteOffset[3];
+		double dAmplitude[3];
+		int nWave[3];
+		double dLFOHertz;
+		double dLFOAmplitude;
+		double dNoise;
+	};
+
+	// sin(2PI * fCycles) for fCycles > -8, branch free so that it vectorises.
+	// Folds the phase into a quarter wave and evaluates a Taylor polynomial
+	// (error < 2e-6).
+	inline float sin_cycles(float fCycles)
+	{
+		float x = fCycles - ((float)(int)(fCycles + 8.5f) - 8.0f);
+		float a = fabsf(x);
+		float b = 0.5f - a;
+		a = a < b ? a : b;
+		float z = copysignf(a, x) * 6.28318530718f;
+		float z2 = z * z;
+		return z * (1.0f + z2 * (-1.0f / 6.0f + z2 * (1.0f / 120.0f + z2 * (-1.0f / 5040.0f + z2 * (1.0f / 362880.0f)))));
+	}
+
+	// Wraps a positive phase in cycles back into [0, 1)
+	inline float wrap_cycles(float fCycles)
+	{
+		return fCycles - (float)(int)fCycles;
+	}
+
+
+	template<typename T>
+	struct instrument_base
+	{
+		T dVolume;
+		double dTimeStep = 1.0 / 44100.0;
+		synth::envelope_adsr<T> env;
+
+		// Oscillators of the instrument. This is its one definition: sound(),
+		// render() and the voice pool's lanes are all built from it.
+		virtual patch recipe() const = 0;
+
+		// Per-sample reference implementation
+		T sound(const double dTime, synth::note n, bool &bNoteFinished)
+		{
+			T dAmplitude = synth::env(dTime, env, n.on, n.off);
+			if (dAmplitude <= T(0)) bNoteFinished = true;
+
+			const patch p = recipe();
+			T dSound = 0;
+			for (int k = 0; k < 3; k++)
+				if (p.dAmplitude[k] != 0.0)
+					dSound += (T)p.dAmplitude[k] * synth::osc<T>(dTime - n.on, scale(n.id + p.nNoteOffset[k]), p.nWave[k],
+						k == 0 ? p.dLFOHertz : 0.0, k == 0 ? p.dLFOAmplitude : 0.0);
+			if (p.dNoise != 0.0)
+				dSound += (T)p.dNoise * synth::osc<T>(dTime - n.on, 0.0, OSC_NOISE);
+
+			return dAmplitude * dSound * dVolume;
+		}
+
+		// Scalar reference for the voice pool's lanes, in double phase and
+		// libm sin(). Fill pOut with nFrames (<= BLOCK_FRAMES_MAX) of the
+		// voice, advancing its state.
+		void render(voice<T> &v, T *pOut, int nFrames)
+		{
+			T dEnv[BLOCK_FRAMES_MAX];
+			envelope_block(v, dEnv, nFrames);
+
+			const patch p = recipe();
+			double dInc[3];
+			T dAmp[3];
+			bool bSquare[3];
+			for (int k = 0; k < 3; k++)
+			{
+				dInc[k] = w(scale(v.id + p.nNoteOffset[k])) * dTimeStep;
+				dAmp[k] = (T)p.dAmplitude[k];
+				bSquare[k] = p.nWave[k] == OSC_SQUARE;
+			}
+			const double dIncLFO = w(p.dLFOHertz) * dTimeStep;
+			const T dDepth = (T)(p.dLFOAmplitude * scale(v.id + p.nNoteOffset[0]));
+			const T dNoise = (T)p.dNoise;
+
+			double p0 = v.dPhase[0], p1 = v.dPhase[1], p2 = v.dPhase[2], pl = v.dLFOPhase;
+			unsigned int nSeed = v.nNoiseSeed;
+			for (int n = 0; n < nFrames; n++)
+			{
+				T s0 = sin((T)p0 + dDepth * sin((T)pl));
+				T s1 = sin((T)p1);
+				T s2 = sin((T)p2);
+				T dSound =
+					+ dAmp[0] * (bSquare[0] ? sign(s0) : s0)
+					+ dAmp[1] * (bSquare[1] ? sign(s1) : s1)
+					+ dAmp[2] * (bSquare[2] ? sign(s2) : s2)
+					+ dNoise * noise<T>(nSeed);
+
+				pOut[n] = dEnv[n] * dSound * dVolume;
+				p0 += dInc[0]; p1 += dInc[1]; p2 += dInc[2]; pl += dIncLFO;
+			}
+
+			v.dPhase[0] = wrap_phase(p0);
+			v.dPhase[1] = wrap_phase(p1);
+			v.dPhase[2] = wrap_phase(p2);
+			v.dLFOPhase = wrap_phase(pl);
+			v.nNoiseSeed = nSeed;
+		}
+
+		virtual void note_on(voice<T> &v)
+		{
+			v.pInstrument = this;
+			v.active = true;
+			v.bReleased = false;
+			v.dLife = 0.0;
+			v.dPhase[0] = v.dPhase[1] = v.dPhase[2] = 0.0;
+			v.dLFOPhase = 0.0;
+			env.trigger(v.env, dTimeStep);
+		}
+
+		virtual void note_off(voice<T> &v)
+		{
+			if (v.bReleased) return;
+			v.bReleased = true;
+			env.release(v.env, dTimeStep);
+		}
+
+	protected:
+		// Envelope for a block of the voice. Flags the voice inactive once it
+		// has been released and faded out.
+		void envelope_block(voice<T> &v, T *pEnv, int nFrames)
+		{
+			if (env.process(v.env, pEnv, nFrames, dTimeStep) < nFrames)
+				v.active = false;
+
+			v.dLife += nFrames * dTimeStep;
+		}
+	};
+
+	template<typename T>
+	struct instrument_bell : public instrument_base<T>
+	{
+		instrument_bell()
+		{
+			this->env.dAttackTime = 0.01;
+			this->env.dDecayTime = 1.0;
+			this->env.dSustainAmplitude = 0.0;
+			this->env.dReleaseTime = 1.0;
+
+			this->dVolume = 1.0;
+		}
+
+		virtual patch recipe() const
+		{
+			return { { 12, 24, 36 }, { 1.00, 0.50, 0.25 }, { OSC_SINE, OSC_SINE, OSC_SINE }, 5.0, 0.001, 0.0 };
+		}
+
+	};
+
+	template<typename T>
+	struct instrument_bell8 : public instrument_base<T>
+	{
+		instrument_bell8()
+		{
+			this->env.dAttackTime = 0.01;
+			this->env.dDecayTime = 0.5;
+			this->env.dSustainAmplitude = 0.8;
+			this->env.dReleaseTime = 1.0;
+
+			this->dVolume = 1.0;
+		}
+
+		virtual patch recipe() const
+		{
+			return { { 0, 12, 24 }, { 1.00, 0.50, 0.25 }, { OSC_SQUARE, OSC_SINE, OSC_SINE }, 5.0, 0.001, 0.0 };
+		}
+
+	};
+
+	template<typename T>
+	struct instrument_harmonica : public instrument_base<T>
+	{
+		instrument_harmonica()
+		{
+			this->env.dAttackTime = 0.05;
+			this->env.dDecayTime = 1.0;
+			this->env.dSustainAmplitude = 0.95;
+			this->env.dReleaseTime = 0.1;
+
+			this->dVolume = 1.0;
+		}
+
+		virtual patch recipe() const
+		{
+			return { { 0, 12, 24 }, { 1.00, 0.50, 0.00 }, { OSC_SQUARE, OSC_SQUARE, OSC_SINE }, 5.0, 0.001, 0.05 };
+		}
+
+	};
+	
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Voice Pool
+
+	const int STEAL_OLDEST = 0;
+	const int STEAL_QUIETEST = 1;
+	const int STEAL_RELEASED_FIRST = 2;
+
+	const int POOL_CHANNELS = 16;
+	const int POOL_NOTES = 128;
+
+	// Voices rendered together in one vector register of floats
+#if defined(__AVX512F__)
+	const int SIMD_LANES = 16;
+#elif defined(__AVX__)
+	const int SIMD_LANES = 8;
+#else
+	const int SIMD_LANES = 4;
+#endif
+
+	// Structure-of-arrays oscillator state, one lane per pool slot, so that
+	// SIMD_LANES neighbouring voices can be rendered side by side. Always
+	// float: a voice_pool<double> renders the same lanes and only keeps its
+	// envelopes and mix in double.
+	struct voice_lanes
+	{
+		vector<float> fPhase[3];	// In cycles, [0, 1)
+		vector<float> fInc[3];
+		vector<float> fAmp[3];
+		vector<float> fSquare[3];	// 0 = sine, 1 = square
+		vector<float> fLFOPhase;
+		vector<float> fLFOInc;
+		vector<float> fLFODepth;	// In cycles
+		vector<float> fNoise;
+		vector<unsigned int> nSeed;
+
+		void resize(int nLanes)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				fPhase[k].resize(nLanes, 0.0f);
+				fInc[k].resize(nLanes, 0.0f);
+				fAmp[k].resize(nLanes, 0.0f);
+				fSquare[k].resize(nLanes, 0.0f);
+			}
+			fLFOPhase.resize(nLanes, 0.0f);
+			fLFOInc.resize(nLanes, 0.0f);
+			fLFODepth.resize(nLanes, 0.0f);
+			fNoise.resize(nLanes, 0.0f);
+			nSeed.resize(nLanes, 1);
+		}
+	};
+
+	// Fixed-capacity set of voices. All storage is allocated when the pool is
+	// built, so starting, finding, stopping and stealing voices never allocate.
+	template<typename T>
+	struct voice_pool
+	{
+		vector<voice<T>> vecVoices;	// One slot per voice
+		vector<int> vecFree;		// Stack of unused slots
+		vector<int> vecActive;		// Dense list of sounding slots, for rendering
+		vector<int> vecActivePos;	// Slot -> position in vecActive
+		vector<int> vecLookup;		// (channel, note) -> slot, or -1
+		vector<char> vecGroupLive;	// Per lane group, has anything to render
+		voice_lanes lanes;
+		int nFree;
+		int nActive;
+		int nPolyphony;
+		int nStealPolicy;
+		unsigned int nSerial;
+
+		voice_pool(int nCapacity = 64, int nStealMode = STEAL_RELEASED_FIRST)
+		{
+			vecVoices.resize(nCapacity);
+			vecFree.resize(nCapacity);
+			vecActive.resize(nCapacity);
+			vecActivePos.resize(nCapacity, -1);
+			vecLookup.resize(POOL_CHANNELS * POOL_NOTES, -1);
+			int nGroups = (nCapacity + SIMD_LANES - 1) / SIMD_LANES;
+			vecGroupLive.resize(nGroups, 0);
+			lanes.resize(nGroups * SIMD_LANES);
+			for (int i = 0; i < nCapacity; i++)
+				vecFree[i] = nCapacity - 1 - i;
+			nFree = nCapacity;
+			nActive = 0;
+			nPolyphony = nCapacity;
+			nStealPolicy = nStealMode;
+			nSerial = 0;
+		}
+
+		int capacity() const { return (int)vecVoices.size(); }
+		int active() const { return nActive; }
+
+		// Limit the number of simultaneous voices, up to the pool capacity
+		void set_polyphony(int nVoices)
+		{
+			nPolyphony = max(1, min(nVoices, capacity()));
+		}
+
+		// i-th sounding voice
+		voice<T>& operator[](int i) { return vecVoices[vecActive[i]]; }
+
+		voice<T>* find(int nChannel, int nNote)
+		{
+			if (nChannel < 0 || nChannel >= POOL_CHANNELS || nNote < 0 || nNote >= POOL_NOTES)
+				return nullptr;
+			int nSlot = vecLookup[nChannel * POOL_NOTES + nNote];
+			return nSlot < 0 ? nullptr : &vecVoices[nSlot];
+		}
+
+		// Claim a voice for (channel, note), stealing one if the polyphony limit
+		// is reached. The caller starts it with the instrument's note_on().
+		voice<T>* allocate(int nChannel, int nNote)
+		{
+			if (nChannel < 0 || nChannel >= POOL_CHANNELS || nNote < 0 || nNote >= POOL_NOTES)
+				return nullptr;
+
+			int nSlot;
+			if (nActive < nPolyphony && nFree > 0)
+			{
+				nSlot = vecFree[--nFree];
+				vecActivePos[nSlot] = nActive;
+				vecActive[nActive++] = nSlot;
+			}
+			else
+			{
+				nSlot = victim();
+				voice<T> &old = vecVoices[nSlot];
+				vecLookup[old.channel * POOL_NOTES + old.id] = -1;
+			}
+
+			voice<T> &v = vecVoices[nSlot];
+			v = voice<T>();
+			v.channel = nChannel;
+			v.id = nNote;
+			v.nSerial = nSerial++;
+			vecLookup[nChannel * POOL_NOTES + nNote] = nSlot;
+			return &v;
+		}
+
+		// Load the oscillators of a voice that has just been started by its
+		// instrument into the voice's lanes
+		void start(voice<T> &v, double dGain)
+		{
+			const int nSlot = (int)(&v - &vecVoices[0]);
+			const instrument_base<T> &inst = *v.pInstrument;
+			const patch p = inst.recipe();
+
+			for (int k = 0; k < 3; k++)
+			{
+				lanes.fPhase[k][nSlot] = 0.0f;
+				lanes.fInc[k][nSlot] = (float)(scale(v.id + p.nNoteOffset[k]) * inst.dTimeStep);
+				lanes.fAmp[k][nSlot] = (float)(p.dAmplitude[k] * inst.dVolume * dGain);
+				lanes.fSquare[k][nSlot] = p.nWave[k] == OSC_SQUARE ? 1.0f : 0.0f;
+			}
+			lanes.fLFOPhase[nSlot] = 0.0f;
+			lanes.fLFOInc[nSlot] = (float)(p.dLFOHertz * inst.dTimeStep);
+			lanes.fLFODepth[nSlot] = (float)(p.dLFOAmplitude * scale(v.id + p.nNoteOffset[0]) / (2.0 * PI));
+			lanes.fNoise[nSlot] = (float)(p.dNoise * inst.dVolume * dGain);
+			lanes.nSeed[nSlot] = 0x9E3779B9u * (v.nSerial + 1);
+			v.nNoiseSeed = lanes.nSeed[nSlot];	// So instrument_base::render() makes the same noise
+		}
+
+		// Add nFrames of every sounding voice into pOut. Voices are rendered a
+		// lane group at a time, and groups with nothing sounding are skipped.
+		void render(T *pOut, int nFrames)
+		{
+			mark_groups();
+			for (int g = 0; g < groups(); g++)
+				if (group_live(g))
+					render_group(g, pOut, nFrames);
+		}
+
+		int groups() const { return (int)vecGroupLive.size(); }
+		bool group_live(int nGroup) const { return vecGroupLive[nGroup] != 0; }
+
+		// Flag the lane groups that hold at least one sounding voice
+		void mark_groups()
+		{
+			for (auto &b : vecGroupLive)
+				b = 0;
+			for (int i = 0; i < nActive; i++)
+				vecGroupLive[vecActive[i] / SIMD_LANES] = 1;
+		}
+
+		// Return every voice that has finished to the free list
+		void collect()
+		{
+			for (int i = nActive - 1; i >= 0; i--)
+			{
+				int nSlot = vecActive[i];
+				voice<T> &v = vecVoices[nSlot];
+				if (v.active)
+					continue;
+
+				vecLookup[v.channel * POOL_NOTES + v.id] = -1;
+
+				// Swap-remove from the dense list
+				int nLast = vecActive[--nActive];
+				vecActive[i] = nLast;
+				vecActivePos[nLast] = i;
+				vecActivePos[nSlot] = -1;
+				vecFree[nFree++] = nSlot;
+			}
+		}
+
+		// Add nFrames of one lane group into pOut. Groups share no state, so
+		// different groups may be rendered on different threads.
+		void render_group(int nGroup, T *pOut, int nFrames)
+		{
+			const int nBase = nGroup * SIMD_LANES;
+
+			alignas(64) float p0[SIMD_LANES], p1[SIMD_LANES], p2[SIMD_LANES];
+			alignas(64) float i0[SIMD_LANES], i1[SIMD_LANES], i2[SIMD_LANES];
+			alignas(64) float a0[SIMD_LANES], a1[SIMD_LANES], a2[SIMD_LANES];
+			alignas(64) float q0[SIMD_LANES], q1[SIMD_LANES], q2[SIMD_LANES];
+			alignas(64) float lp[SIMD_LANES], li[SIMD_LANES], ld[SIMD_LANES], nz[SIMD_LANES];
+			alignas(64) float lvl[SIMD_LANES], mul[SIMD_LANES], add[SIMD_LANES];
+			alignas(64) unsigned int seed[SIMD_LANES];
+			int nRemain[SIMD_LANES];
+			bool bLive[SIMD_LANES];
+
+			// Gather
+			for (int l = 0; l < SIMD_LANES; l++)
+			{
+				const int nSlot = nBase + l;
+				bLive[l] = nSlot < capacity() && vecVoices[nSlot].active && vecVoices[nSlot].pInstrument != nullptr;
+
+				p0[l] = lanes.fPhase[0][nSlot]; i0[l] = lanes.fInc[0][nSlot]; q0[l] = lanes.fSquare[0][nSlot];
+				p1[l] = lanes.fPhase[1][nSlot]; i1[l] = lanes.fInc[1][nSlot]; q1[l] = lanes.fSquare[1][nSlot];
+				p2[l] = lanes.fPhase[2][nSlot]; i2[l] = lanes.fInc[2][nSlot]; q2[l] = lanes.fSquare[2][nSlot];
+				lp[l] = lanes.fLFOPhase[nSlot]; li[l] = lanes.fLFOInc[nSlot]; ld[l] = lanes.fLFODepth[nSlot];
+				seed[l] = lanes.nSeed[nSlot];
+
+				if (bLive[l])
+				{
+					const envelope_state<T> &e = vecVoices[nSlot].env;
+					a0[l] = lanes.fAmp[0][nSlot]; a1[l] = lanes.fAmp[1][nSlot]; a2[l] = lanes.fAmp[2][nSlot];
+					nz[l] = lanes.fNoise[nSlot];
+					lvl[l] = (float)e.dLevel; mul[l] = (float)e.dMul; add[l] = (float)e.dAdd;
+					nRemain[l] = e.nStage == ENV_IDLE ? 0 : e.nRemaining;
+				}
+				else
+				{
+					// Masked lane: silent, and never the next to change stage
+					a0[l] = a1[l] = a2[l] = nz[l] = 0.0f;
+					lvl[l] = 0.0f; mul[l] = 1.0f; add[l] = 0.0f;
+					nRemain[l] = INT_MAX;
+				}
+			}
+
+			int n = 0;
+			while (n < nFrames)
+			{
+				// Run up to the next envelope stage change in any lane
+				int nRun = nFrames - n;
+				for (int l = 0; l < SIMD_LANES; l++)
+					nRun = min(nRun, nRemain[l]);
+
+				for (int i = 0; i < nRun; i++)
+				{
+					alignas(64) float fOut[SIMD_LANES];
+					for (int l = 0; l < SIMD_LANES; l++)
+					{
+						float s0 = sin_cycles(p0[l] + ld[l] * sin_cycles(lp[l]));
+						float s1 = sin_cycles(p1[l]);
+						float s2 = sin_cycles(p2[l]);
+						float o0 = s0 + q0[l] * (copysignf(1.0f, s0) - s0);
+						float o1 = s1 + q1[l] * (copysignf(1.0f, s1) - s1);
+						float o2 = s2 + q2[l] * (copysignf(1.0f, s2) - s2);
+
+						seed[l] = seed[l] * 1664525u + 1013904223u;
+						float fNoise = (float)(int)(seed[l] >> 8) * (2.0f / 16777216.0f) - 1.0f;
+
+						lvl[l] = lvl[l] * mul[l] + add[l];
+						fOut[l] = lvl[l] * (a0[l] * o0 + a1[l] * o1 + a2[l] * o2 + nz[l] * fNoise);
+
+						p0[l] = wrap_cycles(p0[l] + i0[l]);
+						p1[l] = wrap_cycles(p1[l] + i1[l]);
+						p2[l] = wrap_cycles(p2[l] + i2[l]);
+						lp[l] = wrap_cycles(lp[l] + li[l]);
+					}
+
+					float fMix = 0.0f;
+					for (int l = 0; l < SIMD_LANES; l++)
+						fMix += fOut[l];
+					pOut[n + i] += fMix;
+				}
+				n += nRun;
+
+				// Stage changes are rare, so they are handled per lane
+				for (int l = 0; l < SIMD_LANES; l++)
+				{
+					if (nRemain[l] == INT_MAX)
+						continue;
+
+					nRemain[l] -= nRun;
+					if (nRemain[l] > 0)
+						continue;
+
+					voice<T> &v = vecVoices[nBase + l];
+					v.env.dLevel = lvl[l];
+					v.env.nRemaining = 0;
+					v.pInstrument->env.next(v.env, v.pInstrument->dTimeStep);
+
+					if (v.env.nStage == ENV_IDLE)
+					{
+						v.active = false;
+						bLive[l] = false;
+						a0[l] = a1[l] = a2[l] = nz[l] = 0.0f;
+						lvl[l] = 0.0f; mul[l] = 1.0f; add[l] = 0.0f;
+						nRemain[l] = INT_MAX;
+					}
+					else
+					{
+						lvl[l] = (float)v.env.dLevel; mul[l] = (float)v.env.dMul; add[l] = (float)v.env.dAdd;
+						nRemain[l] = v.env.nRemaining;
+					}
+				}
+			}
+
+			// Scatter
+			for (int l = 0; l < SIMD_LANES; l++)
+			{
+				const int nSlot = nBase + l;
+				lanes.fPhase[0][nSlot] = p0[l];
+				lanes.fPhase[1][nSlot] = p1[l];
+				lanes.fPhase[2][nSlot] = p2[l];
+				lanes.fLFOPhase[nSlot] = lp[l];
+				lanes.nSeed[nSlot] = seed[l];
+
+				if (bLive[l])
+				{
+					voice<T> &v = vecVoices[nSlot];
+					v.env.dLevel = lvl[l];
+					v.env.nRemaining = nRemain[l];
+					v.dLife += nFrames * v.pInstrument->dTimeStep;
+				}
+			}
+		}
+
+	private:
+		// Choose a sounding voice to reuse according to the steal policy
+		int victim()
+		{
+			int nBest = vecActive[0];
+			for (int i = 1; i < nActive; i++)
+			{
+				int nSlot = vecActive[i];
+				const voice<T> &v = vecVoices[nSlot];
+				const voice<T> &b = vecVoices[nBest];
+
+				bool bBetter = false;
+				switch (nStealPolicy)
+				{
+				case STEAL_QUIETEST:
+					bBetter = v.env.dLevel < b.env.dLevel;
+					break;
+				case STEAL_RELEASED_FIRST:
+					if (v.bReleased != b.bReleased)
+						bBetter = v.bReleased;
+					else
+						bBetter = (int)(v.nSerial - b.nSerial) < 0;
+					break;
+				case STEAL_OLDEST: default:
+					bBetter = (int)(v.nSerial - b.nSerial) < 0;
+					break;
+				}
+
+				if (bBetter)
+					nBest = nSlot;
+			}
+			return nBest;
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Voice Workers
+
+	// A fixed team of real-time threads that share out the pool's lane groups
+	// each block. Every group renders into its own buffer and the buffers are
+	// summed in group order, so the mix is bit-identical to pool.render()
+	// whatever the number of threads. Both sides spin briefly for the other and
+	// then sleep on a condition variable, so an idle team costs one wake-up per
+	// helper per block rather than a core each.
+	template<typename T>
+	struct voice_workers
+	{
+		voice_pool<T> &pool;
+		int nThreads;
+		vector<thread> vecThreads;
+		vector<int> vecLive;		// Live lane groups this block
+		vector<T> vecGroupOut;	// BLOCK_FRAMES_MAX per lane group
+		int nLive;
+		int nJobFrames;
+		atomic<unsigned int> nGeneration;
+		atomic<int> nDone;
+		atomic<bool> bQuit;
+		mutex muxWake;
+		condition_variable cvWork;	// Helpers sleep here between blocks
+		condition_variable cvDone;	// The caller sleeps here for the helpers
+		int nSleeping;				// Helpers asleep on cvWork, under muxWake
+		bool bWaiting;				// Caller asleep on cvDone, under muxWake
+
+		static const int SPIN_LIMIT = 2048;
+
+		voice_workers(voice_pool<T> &p) : pool(p)
+		{
+			nThreads = 1;
+			nLive = 0;
+			nJobFrames = 0;
+			nGeneration = 0;
+			nDone = 0;
+			bQuit = false;
+			nSleeping = 0;
+			bWaiting = false;
+			vecLive.resize(pool.groups());
+			vecGroupOut.resize(pool.groups() * BLOCK_FRAMES_MAX);
+		}
+
+		~voice_workers()
+		{
+			stop();
+		}
+
+		// Spin up nCount - 1 helper threads; the caller's thread is the other one
+		void start(int nCount)
+		{
+			stop();
+			nThreads = max(1, nCount);
+			bQuit = false;
+			unsigned int nSeen = nGeneration.load();
+			for (int w = 1; w < nThreads; w++)
+				vecThreads.emplace_back(&voice_workers::worker, this, w, nSeen);
+		}
+
+		void stop()
+		{
+			{
+				lock_guard<mutex> lm(muxWake);
+				bQuit = true;
+			}
+			cvWork.notify_all();
+			for (auto &t : vecThreads)
+				t.join();
+			vecThreads.clear();
+			nThreads = 1;
+		}
+
+		// Add nFrames (<= BLOCK_FRAMES_MAX) of every sounding voice into pOut
+		void render(T *pOut, int nFrames)
+		{
+			if (nThreads == 1)
+			{
+				pool.render(pOut, nFrames);
+				return;
+			}
+
+			pool.mark_groups();
+			nLive = 0;
+			for (int g = 0; g < pool.groups(); g++)
+				if (pool.group_live(g))
+					vecLive[nLive++] = g;
+
+			nJobFrames = nFrames;
+			nDone.store(0, memory_order_relaxed);
+			int nAsleep;
+			{
+				lock_guard<mutex> lm(muxWake);
+				nGeneration.fetch_add(1, memory_order_release);
+				nAsleep = nSleeping;
+			}
+			if (nAsleep > 0)
+				cvWork.notify_all();
+
+			share(0);
+
+			auto finished = [this] { return nDone.load(memory_order_acquire) >= nThreads - 1; };
+			for (int nSpin = 0; !finished() && nSpin < SPIN_LIMIT; nSpin++);
+			if (!finished())
+			{
+				unique_lock<mutex> lm(muxWake);
+				bWaiting = true;
+				cvDone.wait(lm, finished);
+				bWaiting = false;
+			}
+
+			for (int i = 0; i < nLive; i++)
+			{
+				const T *pGroup = &vecGroupOut[vecLive[i] * BLOCK_FRAMES_MAX];
+				for (int n = 0; n < nFrames; n++)
+					pOut[n] += pGroup[n];
+			}
+		}
+
+	private:
+		// Worker w always takes the same contiguous run of the live groups
+		void share(int w)
+		{
+			int nBegin = nLive * w / nThreads;
+			int nEnd = nLive * (w + 1) / nThreads;
+			for (int i = nBegin; i < nEnd; i++)
+			{
+				T *pGroup = &vecGroupOut[vecLive[i] * BLOCK_FRAMES_MAX];
+				for (int n = 0; n < nJobFrames; n++)
+					pGroup[n] = 0;
+				pool.render_group(vecLive[i], pGroup, nJobFrames);
+			}
+		}
+
+		void worker(int w, unsigned int nSeen)
+		{
+#ifdef _WIN32
+			SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+#endif
+			auto woken = [this, &nSeen] { return nGeneration.load(memory_order_acquire) != nSeen || bQuit; };
+			while (true)
+			{
+				for (int nSpin = 0; !woken() && nSpin < SPIN_LIMIT; nSpin++);
+				if (!woken())
+				{
+					unique_lock<mutex> lm(muxWake);
+					nSleeping++;
+					cvWork.wait(lm, woken);
+					nSleeping--;
+				}
+
+				if (bQuit)
+					return;
+
+				nSeen = nGeneration.load(memory_order_acquire);
+				share(w);
+
+				// The last helper in wakes the caller if it has gone to sleep
+				if (nDone.fetch_add(1, memory_order_release) == nThreads - 2)
+				{
+					lock_guard<mutex> lm(muxWake);
+					if (bWaiting)
+						cvDone.notify_one();
+				}
+			}
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Events
+
+	const int EVENT_NOTE_ON = 0;
+	const int EVENT_NOTE_OFF = 1;
+	const int EVENT_CONTROL = 2;
+
+	// Something the sequencer wants the audio thread to do, and when
+	struct event
+	{
+		long long nTime;	// Sample clock time the event is due
+		int nType;
+		int nChannel;
+		int nData1;		// Note, or controller number
+		int nData2;		// Velocity, or controller value
+	};
+
+	// Wait-free single producer, single consumer ring of events, which must be
+	// pushed in time order. The producer
+	// only writes nTail and the consumer only writes nHead, each on its own
+	// cache line, so neither side ever waits on the other.
+	struct event_queue
+	{
+		vector<event> vecRing;
+		unsigned int nMask;
+		alignas(64) atomic<unsigned int> nHead;
+		alignas(64) atomic<unsigned int> nTail;
+
+		// Capacity is rounded up to a power of two
+		event_queue(unsigned int nCapacity = 4096)
+		{
+			unsigned int nSize = 1;
+			while (nSize < nCapacity) nSize <<= 1;
+			vecRing.resize(nSize);
+			nMask = nSize - 1;
+			nHead = 0;
+			nTail = 0;
+		}
+
+		// Producer side. Returns false if the queue is full.
+		bool push(const event &e)
+		{
+			unsigned int nT = nTail.load(memory_order_relaxed);
+			if (nT - nHead.load(memory_order_acquire) > nMask)
+				return false;
+			vecRing[nT & nMask] = e;
+			nTail.store(nT + 1, memory_order_release);
+			return true;
+		}
+
+		// Consumer side. Looks at the oldest event without taking it.
+		bool peek(event &e)
+		{
+			unsigned int nH = nHead.load(memory_order_relaxed);
+			if (nH == nTail.load(memory_order_acquire))
+				return false;
+			e = vecRing[nH & nMask];
+			return true;
+		}
+
+		// Consumer side. Takes the oldest event.
+		bool pop(event &e)
+		{
+			if (!peek(e))
+				return false;
+			nHead.store(nHead.load(memory_order_relaxed) + 1, memory_order_release);
+			return true;
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Sequencer
+
+	// A song's events in time order, each field in its own array, so scanning
+	// for the next due event only touches the times
+	struct timeline
+	{
+		vector<long long> vecTime;		// Samples from the start of the song
+		vector<unsigned char> vecType;
+		vector<unsigned short> vecChannel;
+		vector<unsigned char> vecData1;
+		vector<unsigned char> vecData2;
+		int nChannels = 0;				// One more than the highest channel used
+
+		size_t size() const
+		{
+			return vecTime.size();
+		}
+
+		long long duration() const
+		{
+			return vecTime.empty() ? 0 : vecTime.back();
+		}
+
+		void reserve(size_t n)
+		{
+			vecTime.reserve(n);
+			vecType.reserve(n);
+			vecChannel.reserve(n);
+			vecData1.reserve(n);
+			vecData2.reserve(n);
+		}
+
+		// Events must be pushed in time order
+		void push(const event &e)
+		{
+			vecTime.push_back(e.nTime);
+			vecType.push_back((unsigned char)e.nType);
+			vecChannel.push_back((unsigned short)e.nChannel);
+			vecData1.push_back((unsigned char)e.nData1);
+			vecData2.push_back((unsigned char)e.nData2);
+			nChannels = max(nChannels, e.nChannel + 1);
+		}
+
+		event operator[](size_t i) const
+		{
+			return { vecTime[i], vecType[i], vecChannel[i], vecData1[i], vecData2[i] };
+		}
+
+		// Index of the first event at or after nTime
+		size_t find(long long nTime) const
+		{
+			return lower_bound(vecTime.begin(), vecTime.end(), nTime) - vecTime.begin();
+		}
+	};
+
+	// Plays a timeline against the audio thread's sample clock. Nothing
+	// happens between events: the audio thread asks when the next one is due
+	// and takes it once that sample arrives. Playback can start anywhere in
+	// the song and can loop a section of it; whenever it jumps, every channel
+	// gets an All Notes Off so nothing is left hanging.
+	//
+	// Nothing here is synchronised. Once the audio thread is playing it, only
+	// the audio thread may call start() or loop(), between blocks.
+	struct sequencer
+	{
+		timeline song;
+		size_t nCursor = 0;
+		long long nStart = 0;		// Sample clock time of the start of the song
+		long long nLoopStart = 0;
+		long long nLoopEnd = 0;		// No loop while this is not after nLoopStart
+		int nFlush = 0;				// Channels still to be sent All Notes Off
+		long long nFlushTime = 0;
+
+		void load(timeline t)
+		{
+			song = move(t);
+			nCursor = 0;
+			nFlush = 0;
+		}
+
+		// Plays from song position nFrom, which is heard at sample clock time
+		// nClock. Also seeks, when called on the audio thread while playing.
+		void start(long long nClock, long long nFrom = 0)
+		{
+			nStart = nClock - nFrom;
+			nCursor = song.find(nFrom);
+			flush(nClock);
+		}
+
+		// Repeats song positions [nFrom, nTo) once playback reaches nTo.
+		// nTo <= nFrom turns looping off.
+		void loop(long long nFrom, long long nTo)
+		{
+			nLoopStart = nFrom;
+			nLoopEnd = nTo;
+		}
+
+		bool finished()
+		{
+			return next() == LLONG_MAX;
+		}
+
+		// Sample clock time of the next event, LLONG_MAX if there is none
+		long long next()
+		{
+			if (nFlush > 0)
+				return nFlushTime;
+
+			if (nLoopEnd > nLoopStart && (nCursor >= song.size() || song.vecTime[nCursor] >= nLoopEnd))
+			{
+				flush(nStart + nLoopEnd);
+				nStart += nLoopEnd - nLoopStart;
+				nCursor = song.find(nLoopStart);
+				return nFlushTime;
+			}
+
+			return nCursor < song.size() ? nStart + song.vecTime[nCursor] : LLONG_MAX;
+		}
+
+		// Removes the next event, stamped in sample clock time. Only call
+		// after next() has said one is due.
+		event take()
+		{
+			if (nFlush > 0)
+			{
+				nFlush--;
+				return { nFlushTime, EVENT_CONTROL, nFlush, 123, 0 };
+			}
+
+			event e = song[nCursor++];
+			e.nTime += nStart;
+			return e;
+		}
+
+	private:
+		void flush(long long nTime)
+		{
+			nFlush = song.nChannels;
+			nFlushTime = nTime;
+		}
+	};
+}
+
+// Both sample types are built, whichever one the program renders in
+template struct synth::envelope_adsr<float>;
+template struct synth::envelope_adsr<double>;
+template struct synth::instrument_bell<float>;
+template struct synth::instrument_bell<double>;
+template struct synth::instrument_bell8<float>;
+template struct synth::instrument_bell8<double>;
+template struct synth::instrument_harmonica<float>;
+template struct synth::instrument_harmonica<double>;
+template struct synth::voice_pool<float>;
+template struct synth::voice_pool<double>;
+template struct synth::voice_workers<float>;
+template struct synth::voice_workers<double>;
+
+// Sample type the live synth renders in
+typedef float SAMPLE;
+
+synth::voice_pool<SAMPLE> voices(256);
+synth::voice_workers<SAMPLE> workers(voices);
+
+// Threads sharing the voice rendering: one unless the command line says
+// "--threads N", raise for very dense MIDI files. N of 0 means one per core.
+int RenderThreads(int argc, char *argv[])
+{
+	int nThreads = 1;
+	for (int i = 1; i + 1 < argc; i++)
+		if (strcmp(argv[i], "--threads") == 0)
+			nThreads = atoi(argv[i + 1]);
+	if (nThreads <= 0)
+		nThreads = max(1u, thread::hardware_concurrency());
+	return nThreads;
+}
+
+// Live note and controller events for the audio thread, and the audio
+// thread's sample clock they are stamped against
+synth::event_queue queueEvents;
+atomic<long long> nSampleClock(0);
+
+// The song, played by the audio thread
+synth::sequencer song;
+
+// Which notes are down, for display only
+atomic<bool> bNoteHeld[128];
+synth::instrument_bell<SAMPLE> instBell;
+synth::instrument_harmonica<SAMPLE> instHarm;
+
+// Instrument assigned to a MIDI channel, nullptr if the channel is silent
+synth::instrument_base<SAMPLE>* ChannelInstrument(int nChannel)
+{
+	if (nChannel == 2) return &instBell;
+	if (nChannel == 1) return &instHarm;
+	return nullptr;
+}
+
+double ChannelGain(int nChannel)
+{
+	return nChannel == 1 ? 0.5 : 1.0;
+}
+
+
+
+// A whole file's bytes, read only. Memory mapped on Windows, otherwise read
+// into one buffer up front; either way parsing never touches a stream.
+struct midi_bytes
+{
+	const unsigned char *pData = nullptr;
+	size_t nSize = 0;
+
+	midi_bytes(const wstring &sFilename)
+	{
+#ifdef _WIN32
+		hFile = CreateFileW(sFilename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return;
+
+		LARGE_INTEGER nFileSize;
+		if (!GetFileSizeEx(hFile, &nFileSize) || nFileSize.QuadPart == 0)
+			return;
+
+		hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (hMapping == nullptr)
+			return;
+
+		pData = (const unsigned char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+		if (pData != nullptr)
+			nSize = (size_t)nFileSize.QuadPart;
+#else
+		ifstream fs(filesystem::path(sFilename), ios::binary | ios::ate);
+		if (!fs.is_open())
+			return;
+
+		vecBuffer.resize((size_t)fs.tellg());
+		fs.seekg(0);
+		fs.read((char*)vecBuffer.data(), vecBuffer.size());
+		pData = vecBuffer.data();
+		nSize = (size_t)fs.gcount();
+#endif
+	}
+
+	~midi_bytes()
+	{
+#ifdef _WIN32
+		if (pData != nullptr) UnmapViewOfFile(pData);
+		if (hMapping != nullptr) CloseHandle(hMapping);
+		if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+#endif
+	}
+
+	midi_bytes(const midi_bytes&) = delete;
+	midi_bytes& operator=(const midi_bytes&) = delete;
+
+private:
+#ifdef _WIN32
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	HANDLE hMapping = nullptr;
+#else
+	vector<unsigned char> vecBuffer;
+#endif
+};
+
+// Reads big-endian MIDI fields from a span of bytes. Every read is bounds
+// checked: running off the end yields zeros and sets bOverrun, so a truncated
+// or corrupt file ends the parse rather than reading past the buffer.
+struct midi_cursor
+{
+	const unsigned char *p = nullptr;
+	const unsigned char *pEnd = nullptr;
+	bool bOverrun = false;
+
+	midi_cursor() {}
+	midi_cursor(const unsigned char *pBegin, size_t nSize) : p(pBegin), pEnd(pBegin + nSize) {}
+
+	size_t remaining() const { return (size_t)(pEnd - p); }
+	bool done() const { return p >= pEnd || bOverrun; }
+
+	unsigned int u8()
+	{
+		if (p >= pEnd) { bOverrun = true; return 0; }
+		return *p++;
+	}
+
+	unsigned int u16()
+	{
+		if (remaining() < 2) { overrun(); return 0; }
+		unsigned int n = (p[0] << 8) | p[1];
+		p += 2;
+		return n;
+	}
+
+	unsigned int u32()
+	{
+		if (remaining() < 4) { overrun(); return 0; }
+		unsigned int n = ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		p += 4;
+		return n;
+	}
+
+	// Variable length quantity, at most four bytes
+	unsigned int var()
+	{
+		unsigned int nValue = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			unsigned int c = u8();
+			nValue = (nValue << 7) | (c & 0x7F);
+			if (!(c & 0x80))
+				break;
+		}
+		return nValue;
+	}
+
+	// The next nLength bytes, without copying them
+	string_view text(size_t nLength)
+	{
+		if (remaining() < nLength) { overrun(); return string_view(); }
+		string_view s((const char*)p, nLength);
+		p += nLength;
+		return s;
+	}
+
+	// Splits off the next nLength bytes as their own cursor
+	midi_cursor chunk(size_t nLength)
+	{
+		if (remaining() < nLength) { nLength = remaining(); bOverrun = true; }
+		midi_cursor c(p, nLength);
+		p += nLength;
+		return c;
+	}
+
+	void skip(size_t nLength)
+	{
+		if (remaining() < nLength) { overrun(); return; }
+		p += nLength;
+	}
+
+private:
+	void overrun() { p = pEnd; bOverrun = true; }
+};
+
+wostream& operator<<(wostream &os, string_view s)
+{
+	for (char c : s)
+		os << (wchar_t)(unsigned char)c;
+	return os;
+}
+
+// Data bytes that follow a status byte. Channel messages are indexed by the
+// status's high nibble (0x80 - 0xE0), system messages by its low nibble
+// (0xF0 - 0xFF). -1 marks a message whose payload has a length of its own:
+// SysEx in a file, or a meta event.
+const int nMidiChannelDataBytes[7] = { 2, 2, 2, 2, 1, 1, 2 };
+const int nMidiSystemDataBytes[16] = { -1, 1, 2, 1, 0, 0, 0, -1, 0, 0, 0, 0, 0, 0, 0, -1 };
+
+enum
+{
+	MIDI_NOTE_OFF = 0x80,
+	MIDI_NOTE_ON = 0x90,
+	MIDI_POLY_PRESSURE = 0xA0,
+	MIDI_CONTROL = 0xB0,
+	MIDI_PROGRAM = 0xC0,
+	MIDI_CHANNEL_PRESSURE = 0xD0,
+	MIDI_PITCH_BEND = 0xE0,
+	MIDI_SYSEX = 0xF0,
+	MIDI_SYSEX_ESCAPE = 0xF7,
+	MIDI_META = 0xFF,
+};
+
+enum
+{
+	META_SEQUENCE_NUMBER = 0x00,
+	META_TEXT = 0x01,				// 0x01 - 0x0F are all text
+	META_CHANNEL_PREFIX = 0x20,
+	META_PORT = 0x21,
+	META_END_OF_TRACK = 0x2F,
+	META_SET_TEMPO = 0x51,
+	META_SMPTE_OFFSET = 0x54,
+	META_TIME_SIGNATURE = 0x58,
+	META_KEY_SIGNATURE = 0x59,
+	META_SEQUENCER = 0x7F,
+};
+
+// One decoded message. SysEx and meta payloads point into the file's bytes,
+// so they are only valid while the file is.
+struct midi_message
+{
+	int nTrack = 0;
+	long long nTick = 0;			// Since the start of the track
+	unsigned int nDelta = 0;		// Since the previous message in the track
+	unsigned char nStatus = 0;		// For channel messages, the low nibble is the channel
+	unsigned char nMeta = 0;		// Meta event type, when nStatus is MIDI_META
+	unsigned char nData1 = 0;
+	unsigned char nData2 = 0;
+	string_view sData;
+
+	int type() const { return nStatus < 0xF0 ? nStatus & 0xF0 : nStatus; }
+	int channel() const { return nStatus & 0x0F; }
+
+	// A Note On with zero velocity is how most files write a Note Off
+	bool note_on() const { return type() == MIDI_NOTE_ON && nData2 > 0; }
+	bool note_off() const { return type() == MIDI_NOTE_OFF || (type() == MIDI_NOTE_ON && nData2 == 0); }
+
+	// Microseconds per quarter note, from a Set Tempo
+	unsigned int tempo() const { return ((unsigned char)sData[0] << 16) | ((unsigned char)sData[1] << 8) | (unsigned char)sData[2]; }
+};
+
+wostream& operator<<(wostream &os, const midi_message &m)
+{
+	const wchar_t *sChannelNames[7] = { L"[NOTE OFF]", L"[NOTE ON ]", L"[POLYPHON]", L"[CONTROL ]", L"[PROGRAM ]", L"[AFTER P ]", L"[PITCH WH]" };
+	const wchar_t *sTextNames[8] = { L"Text", L"Text", L"Copyright", L"Track Name", L"Instrument", L"Lyric", L"Marker", L"Cue" };
+
+	os << L"Track: " << m.nTrack << L" Tick: " << m.nTick << L" ";
+	if (m.nStatus < 0xF0)
+		return os << sChannelNames[(m.nStatus >> 4) - 8] << L" Channel: " << m.channel() << L" Data: " << (int)m.nData1 << L" " << (int)m.nData2;
+	if (m.nStatus != MIDI_META)
+		return os << L"System " << hex << (int)m.nStatus << dec << L" Length: " << m.sData.size();
+	if (m.nMeta < 8)
+		return os << sTextNames[m.nMeta] << L": " << m.sData;
+	return os << L"Meta " << hex << (int)m.nMeta << dec << L" Length: " << m.sData.size();
+}
+
+// Decodes one track chunk, calling visit(const midi_message&) for every
+// message in it, up to and including End of Track. SysEx and the other system
+// messages cancel running status, as they do in midi_stream. The one exception
+// to the standard is that running status survives meta events, which some
+// files rely on. Returns false if the track is cut short or a data byte turns
+// up with no running status to use.
+template<typename F>
+bool midi_decode_track(midi_cursor track, int nTrack, F &&visit)
+{
+	midi_message m;
+	m.nTrack = nTrack;
+	unsigned char nRunning = 0;
+
+	while (!track.done())
+	{
+		m.nDelta = track.var();
+		m.nTick += m.nDelta;
+		m.nMeta = 0;
+		m.nData1 = m.nData2 = 0;
+		m.sData = string_view();
+
+		unsigned int nByte = track.u8();
+		bool bRunning = nByte < 0x80;
+		if (bRunning)
+		{
+			if (nRunning == 0)
+				return false;
+			m.nStatus = nRunning;
+		}
+		else
+			m.nStatus = (unsigned char)nByte;
+
+		int nBytes;
+		if (m.nStatus < 0xF0)
+		{
+			nRunning = m.nStatus;
+			nBytes = nMidiChannelDataBytes[(m.nStatus >> 4) - 8];
+		}
+		else
+		{
+			nBytes = nMidiSystemDataBytes[m.nStatus & 0x0F];
+			if (m.nStatus == MIDI_META)
+				m.nMeta = (unsigned char)track.u8();
+			else
+				nRunning = 0;
+		}
+
+		if (nBytes < 0)
+			m.sData = track.text(track.var());
+		else
+		{
+			if (nBytes > 0) m.nData1 = (unsigned char)(bRunning ? nByte : track.u8());
+			if (nBytes > 1) m.nData2 = (unsigned char)track.u8();
+		}
+
+		if (track.bOverrun)
+			return false;
+
+		visit(m);
+
+		if (m.nStatus == MIDI_META && m.nMeta == META_END_OF_TRACK)
+			return true;
+	}
+
+	// Ran out of bytes without an End of Track
+	return false;
+}
+
+// Decodes a live MIDI byte stream, fed in pieces of any size. A message split
+// across pieces is finished when the rest arrives, and running status carries
+// over from one piece to the next. Real time bytes (0xF8 - 0xFF) can turn up
+// in the middle of another message and are passed on at once. SysEx is
+// gathered into a fixed buffer, dropping whatever doesn't fit, so decoding
+// never allocates.
+struct midi_stream
+{
+	static const int SYSEX_MAX = 256;
+
+	unsigned char nRunning = 0;
+	unsigned char nStatus = 0;		// Message being gathered, 0 if none
+	unsigned char nData[2] = { 0, 0 };
+	int nHave = 0;
+	int nNeed = 0;
+	bool bSysEx = false;
+	unsigned char nSysEx[SYSEX_MAX];
+	size_t nSysExLength = 0;
+
+	// Calls visit(const midi_message&) for every message completed by these
+	// bytes, stamped with nTime
+	template<typename F>
+	void push(const unsigned char *pBytes, size_t nBytes, long long nTime, F &&visit)
+	{
+		midi_message m;
+		m.nTick = nTime;
+
+		for (size_t i = 0; i < nBytes; i++)
+		{
+			unsigned char b = pBytes[i];
+
+			if (b >= 0xF8)
+			{
+				m.nStatus = b;
+				m.nData1 = m.nData2 = 0;
+				m.sData = string_view();
+				visit(m);
+				continue;
+			}
+
+			if (b & 0x80)
+			{
+				// Any status byte ends a SysEx, though it should be 0xF7
+				if (bSysEx)
+				{
+					bSysEx = false;
+					m.nStatus = MIDI_SYSEX;
+					m.nData1 = m.nData2 = 0;
+					m.sData = string_view((const char*)nSysEx, min(nSysExLength, (size_t)SYSEX_MAX));
+					visit(m);
+				}
+
+				if (b == MIDI_SYSEX_ESCAPE)
+					continue;
+
+				if (b == MIDI_SYSEX)
+				{
+					bSysEx = true;
+					nSysExLength = 0;
+					nRunning = 0;
+					nStatus = 0;
+					continue;
+				}
+
+				// System common messages cancel running status
+				nRunning = b < 0xF0 ? b : 0;
+				begin(b);
+			}
+			else if (bSysEx)
+			{
+				if (nSysExLength < SYSEX_MAX)
+					nSysEx[nSysExLength] = b;
+				nSysExLength++;
+				continue;
+			}
+			else
+			{
+				// A data byte with no status of its own. Without running status
+				// it's garbage, or the tail of a message we joined midway.
+				if (nStatus == 0)
+				{
+					if (nRunning == 0)
+						continue;
+					begin(nRunning);
+				}
+				nData[nHave++] = b;
+			}
+
+			if (nStatus != 0 && nHave == nNeed)
+			{
+				m.nStatus = nStatus;
+				m.nData1 = nData[0];
+				m.nData2 = nData[1];
+				m.sData = string_view();
+				visit(m);
+				nStatus = 0;
+			}
+		}
+	}
+
+private:
+	void begin(unsigned char b)
+	{
+		nStatus = b;
+		nHave = 0;
+		nData[0] = nData[1] = 0;
+		nNeed = b < 0xF0 ? nMidiChannelDataBytes[(b >> 4) - 8] : max(0, nMidiSystemDataBytes[b & 0x0F]);
+	}
+};
+
+// Where each tempo change lands, so a tick converts to a sample position with
+// one binary search. Seeks need no reverse lookup: the timeline is already in
+// samples. With SMPTE division the tick length is fixed by the frame rate and
+// Set Tempo events don't apply.
+struct midi_tempo_map
+{
+	struct segment
+	{
+		long long nTick;			// Where this tempo takes over
+		double dSample;				// The same point, in samples
+		double dSamplesPerTick;
+	};
+
+	vector<segment> vecSegments;
+
+	// vecTempos holds (tick, microseconds per quarter note) for every Set
+	// Tempo in the file, in any order
+	void build(int nDivision, vector<pair<long long, unsigned int>> vecTempos, double dSampleRate)
+	{
+		vecSegments.clear();
+
+		if (nDivision & 0x8000)
+		{
+			// Negative frames per second in the high byte, ticks per frame in
+			// the low byte. 29 frames is really 29.97.
+			int nFramesPerSecond = -(signed char)(nDivision >> 8);
+			double dFramesPerSecond = nFramesPerSecond == 29 ? 30000.0 / 1001.0 : (double)nFramesPerSecond;
+			int nTicksPerFrame = max(1, nDivision & 0xFF);
+			vecSegments.push_back({ 0, 0.0, dSampleRate / (max(1.0, dFramesPerSecond) * nTicksPerFrame) });
+			return;
+		}
+
+		// Ticks per quarter note, and 120 bpm until told otherwise
+		double dTicksPerQuarter = max(1, nDivision);
+		auto samples_per_tick = [&](unsigned int nMicroseconds) { return nMicroseconds * 1e-6 * dSampleRate / dTicksPerQuarter; };
+		vecSegments.push_back({ 0, 0.0, samples_per_tick(500000) });
+
+		stable_sort(vecTempos.begin(), vecTempos.end(), [](const pair<long long, unsigned int> &a, const pair<long long, unsigned int> &b) { return a.first < b.first; });
+		for (auto &t : vecTempos)
+		{
+			segment &s = vecSegments.back();
+			if (t.first == s.nTick)
+				s.dSamplesPerTick = samples_per_tick(t.second);
+			else
+				vecSegments.push_back({ t.first, s.dSample + (t.first - s.nTick) * s.dSamplesPerTick, samples_per_tick(t.second) });
+		}
+	}
+
+	int changes() const
+	{
+		return max(0, (int)vecSegments.size() - 1);
+	}
+
+	double sample(long long nTick) const
+	{
+		auto it = upper_bound(vecSegments.begin() + 1, vecSegments.end(), nTick, [](long long n, const segment &s) { return n < s.nTick; });
+		const segment &s = *(it - 1);
+		return s.dSample + (nTick - s.nTick) * s.dSamplesPerTick;
+	}
+};
+
+struct midifile
+{
+
+	struct midievent
+	{
+		int nTickDelta;
+		int nChannel;
+		int nNote;
+		int nVelocity;
+		bool bSound;
+		double dRealTime;		// Seconds from the start of the song
+		long long nTick;		// Ticks from the start of the song
+		long long nSample;		// Samples from the start of the song
 	};
 
-	struct envelope_adsr : public envelope
+	struct midichannel
 	{
-		FTYPE dAttackTime;
-		FTYPE dDecayTime;
-		FTYPE dSustainAmplitude;
-		FTYPE dReleaseTime;
-		FTYPE dStartAmplitude;
+		vector<midievent> vecEvents;
+		double dLastEventTime;
+	};
 
-		envelope_adsr()
-		{
-			dAttackTime = 0.1;
-			dDecayTime = 0.1;
-			dSustainAmplitude = 1.0;
-			dReleaseTime = 0.2;
-			dStartAmplitude = 1.0;
-		}
 
-		virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff)
-		{
-			FTYPE dAmplitude = 0.0;
-			FTYPE dReleaseAmplitude = 0.0;
+	vector<midichannel> vecChannels;
 
-			if (dTimeOn > dTimeOff) // Note is on
-			{
-				FTYPE dLifeTime = dTime - dTimeOn;
+	// From the file's header
+	int nFormat = 0;
+	int nTracks = 0;
+	int nDivision = 0;
 
-				if (dLifeTime <= dAttackTime)
-					dAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+	// Tick to sample conversion, built once the whole file has been read
+	midi_tempo_map tempo;
+	double dSampleRate = 44100.0;
 
-				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
-					dAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+	// Size of the file parsed, in bytes, and whether every track was read to
+	// its End of Track without running out of data
+	size_t nFileSize = 0;
+	bool bComplete = false;
 
-				if (dLifeTime > (dAttackTime + dDecayTime))
-					dAmplitude = dSustainAmplitude;
-			}
-			else // Note is off
-			{
-				FTYPE dLifeTime = dTimeOff - dTimeOn;
+	// Loads the notes of a file, timed in samples at dSampleRate. bVerbose
+	// prints every message as it's decoded.
+	midifile(wstring sFilename, double dSampleRate = 44100.0, bool bVerbose = false) : dSampleRate(dSampleRate)
+	{
+		midi_bytes file(sFilename);
+		if (file.pData == nullptr)
+			return;
 
-				if (dLifeTime <= dAttackTime)
-					dReleaseAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+		nFileSize = file.nSize;
+		vector<pair<long long, unsigned int>> vecTempos;
+		bComplete = parse(midi_cursor(file.pData, file.nSize), [&](const midi_message &m)
+		{
+			if (bVerbose)
+				wcout << m << endl;
 
-				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
-					dReleaseAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+			while (m.nTrack >= (int)vecChannels.size())
+			{
+				vecChannels.emplace_back();
+				vecChannels.back().dLastEventTime = 0.0;
+			}
 
-				if (dLifeTime > (dAttackTime + dDecayTime))
-					dReleaseAmplitude = dSustainAmplitude;
+			if (m.nStatus == MIDI_META && m.nMeta == META_SET_TEMPO && m.sData.size() >= 3)
+				vecTempos.emplace_back(m.nTick, m.tempo());
+
+			if (m.note_on() || m.note_off())
+			{
+				midievent e;
+				e.nTickDelta = m.nDelta;
+				e.nChannel = m.channel();
+				e.nNote = m.nData1;
+				e.nVelocity = m.nData2;
+				e.bSound = m.note_on();
+				e.nTick = m.nTick;
+				vecChannels[m.nTrack].vecEvents.push_back(e);
+			}
+		});
 
-				dAmplitude = ((dTime - dTimeOff) / dReleaseTime) * (0.0 - dReleaseAmplitude) + dReleaseAmplitude;
+		// Tempo changes in any track apply to all of them, so times are only
+		// known once every track has been read
+		tempo.build(nDivision, move(vecTempos), dSampleRate);
+		for (auto &channel : vecChannels)
+			for (auto &e : channel.vecEvents)
+			{
+				double dSample = tempo.sample(e.nTick);
+				e.nSample = llround(dSample);
+				e.dRealTime = dSample / dSampleRate;
+				channel.dLastEventTime = e.dRealTime;
 			}
+	}
 
-			// Amplitude should not be negative
-			if (dAmplitude <= 0.000)
-				dAmplitude = 0.0;
+	// Decodes the header and every track, calling visit(const midi_message&)
+	// for each message, a track at a time. Returns true if the whole file
+	// was well formed.
+	template<typename F>
+	bool parse(midi_cursor fs, F &&visit)
+	{
+		unsigned int nFileID = fs.u32();
+		unsigned int nHeaderLength = fs.u32();
+		if (nFileID != 0x4D546864 || nHeaderLength < 6)	// "MThd"
+			return false;
+
+		midi_cursor header = fs.chunk(nHeaderLength);
+		nFormat = header.u16();
+		nTracks = header.u16();
+		nDivision = header.u16();
+
+		bool bValid = !fs.bOverrun;
+		int nTrack = 0;
+		while (nTrack < nTracks && !fs.done())
+		{
+			unsigned int nChunkID = fs.u32();
+			unsigned int nChunkLength = fs.u32();
+			midi_cursor chunk = fs.chunk(nChunkLength);
 
-			return dAmplitude;
+			// Skip chunks that aren't "MTrk", as the standard asks
+			if (nChunkID != 0x4D54726B)
+				continue;
+
+			bValid &= midi_decode_track(chunk, nTrack, visit) && !chunk.bOverrun;
+			nTrack++;
 		}
-	};
 
-	FTYPE env(const FTYPE dTime, envelope &env, const FTYPE dTimeOn, const FTYPE dTimeOff)
-	{
-		return env.amplitude(dTime, dTimeOn, dTimeOff);
+		return bValid && nTrack == nTracks;
 	}
+};
 
 
-	struct instrument_base
+// Flattens a MIDI file into one timeline, in samples from the start of the
+// song. Each track plays on the channel numbered by its position in the file.
+// Tracks are already in time order, so they're merged a head at a time rather
+// than sorted; events at the same time keep track order.
+synth::timeline BuildTimeline(midifile &mfile)
+{
+	synth::timeline song;
+	size_t nEvents = 0;
+	for (auto &channel : mfile.vecChannels)
+		nEvents += channel.vecEvents.size();
+	song.reserve(nEvents);
+
+	// Each track's next event, earliest on top
+	typedef pair<long long, int> head;
+	priority_queue<head, vector<head>, greater<head>> queueHeads;
+	vector<size_t> vecNext(mfile.vecChannels.size(), 0);
+	for (int t = 0; t < (int)mfile.vecChannels.size(); t++)
+		if (!mfile.vecChannels[t].vecEvents.empty())
+			queueHeads.push({ mfile.vecChannels[t].vecEvents[0].nSample, t });
+
+	while (!queueHeads.empty())
 	{
-		FTYPE dVolume;
-		synth::envelope_adsr env;
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished) = 0;
-	};
+		int t = queueHeads.top().second;
+		queueHeads.pop();
+
+		auto &vecEvents = mfile.vecChannels[t].vecEvents;
+		const midifile::midievent &evt = vecEvents[vecNext[t]++];
+		synth::event e;
+		e.nTime = evt.nSample;
+		e.nType = evt.bSound ? synth::EVENT_NOTE_ON : synth::EVENT_NOTE_OFF;
+		e.nChannel = t;
+		e.nData1 = evt.nNote;
+		e.nData2 = evt.nVelocity;
+		song.push(e);
+
+		if (vecNext[t] < vecEvents.size())
+			queueHeads.push({ vecEvents[vecNext[t]].nSample, t });
+	}
+
+	return song;
+}
+
+// What a corpus index remembers about one MIDI file, enough to pick or skip
+// files without parsing them again. The file's size and modification time
+// tell whether the entry is still current. Laid out with no padding, so it's
+// written to the index as it is.
+struct midi_summary
+{
+	unsigned long long nFileSize = 0;
+	long long nModified = 0;
+	long long nDuration = 0;		// Samples, at 44100Hz
+	unsigned int nNotes = 0;
+	unsigned short nPolyphony = 0;	// Most notes down at once
+	unsigned short nTempoChanges = 0;
+	unsigned short nChannelMask = 0;	// Bit per MIDI channel with notes on it
+	unsigned short nFlags = 0;
+	unsigned short nPathLength = 0;	// UTF-16 code units of path that follow in the index
+	unsigned short nReserved = 0;
+
+	static const unsigned short FLAG_COMPLETE = 1;
+};
+static_assert(sizeof(midi_summary) == 40, "midi_summary is written to disk as is");
 
-	struct instrument_bell : public instrument_base
+midi_summary Summarise(const midifile &mfile, const synth::timeline &song)
+{
+	midi_summary s;
+	s.nFileSize = mfile.nFileSize;
+	s.nDuration = song.duration();
+	s.nTempoChanges = (unsigned short)min(mfile.tempo.changes(), 0xFFFF);
+	s.nFlags = mfile.bComplete ? midi_summary::FLAG_COMPLETE : 0;
+
+	for (auto &channel : mfile.vecChannels)
+		for (auto &e : channel.vecEvents)
+			s.nChannelMask |= 1 << e.nChannel;
+
+	// Replay the note ons and offs to find the densest moment
+	vector<unsigned char> vecDown(song.nChannels * 128, 0);
+	int nDown = 0, nPeak = 0;
+	for (size_t i = 0; i < song.size(); i++)
 	{
-		instrument_bell()
+		unsigned char &bDown = vecDown[song.vecChannel[i] * 128 + (song.vecData1[i] & 127)];
+		if (song.vecType[i] == synth::EVENT_NOTE_ON)
 		{
-			env.dAttackTime = 0.01;
-			env.dDecayTime = 1.0;
-			env.dSustainAmplitude = 0.0;
-			env.dReleaseTime = 1.0;
-
-			dVolume = 1.0;
+			s.nNotes++;
+			if (!bDown) { bDown = 1; nPeak = max(nPeak, ++nDown); }
+		}
+		else if (song.vecType[i] == synth::EVENT_NOTE_OFF && bDown)
+		{
+			bDown = 0;
+			nDown--;
 		}
+	}
+	s.nPolyphony = (unsigned short)min(nPeak, 0xFFFF);
+	return s;
+}
+
+// Loads a library of MIDI files at once, parsing them across a team of
+// threads which each take the next unclaimed file. Files whose index entry
+// is still current aren't parsed at all unless their timelines are wanted.
+struct midi_corpus
+{
+	vector<wstring> vecFiles;
+	vector<midi_summary> vecSummaries;
+	vector<synth::timeline> vecTimelines;	// Only filled if asked for
+	size_t nParsed = 0;						// Files actually read this time
+	size_t nBytesParsed = 0;
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+	void load(const vector<wstring> &vecPaths, int nThreads, bool bKeepTimelines)
+	{
+		// Remember what the previous index said, by path
+		map<wstring, midi_summary> mapKnown;
+		for (size_t i = 0; i < vecFiles.size(); i++)
+			mapKnown[vecFiles[i]] = vecSummaries[i];
+
+		vecFiles = vecPaths;
+		vecSummaries.assign(vecFiles.size(), midi_summary());
+		vecTimelines.clear();
+		if (bKeepTimelines)
+			vecTimelines.resize(vecFiles.size());
+
+		atomic<size_t> nNext(0), nParsedFiles(0), nParsedBytes(0);
+		auto worker = [&]()
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
+			size_t i;
+			while ((i = nNext.fetch_add(1, memory_order_relaxed)) < vecFiles.size())
+			{
+				error_code ec;
+				unsigned long long nSize = filesystem::file_size(vecFiles[i], ec);
+				long long nModified = ec ? 0 : (long long)filesystem::last_write_time(vecFiles[i], ec).time_since_epoch().count();
 
-			FTYPE dSound =
-				+ 1.00 * synth::osc(dTime - n.on, synth::scale(n.id + 12), synth::OSC_SINE, 5.0, 0.001)
-				+ 0.50 * synth::osc(dTime - n.on, synth::scale(n.id + 24))
-				+ 0.25 * synth::osc(dTime - n.on, synth::scale(n.id + 36));
+				auto known = mapKnown.find(vecFiles[i]);
+				if (!bKeepTimelines && known != mapKnown.end() && known->second.nFileSize == nSize && known->second.nModified == nModified)
+				{
+					vecSummaries[i] = known->second;
+					continue;
+				}
 
-			return dAmplitude * dSound * dVolume;
-		}
+				midifile mfile(vecFiles[i]);
+				synth::timeline song = BuildTimeline(mfile);
+				vecSummaries[i] = Summarise(mfile, song);
+				vecSummaries[i].nModified = nModified;
+				if (bKeepTimelines)
+					vecTimelines[i] = move(song);
 
-	};
+				nParsedFiles.fetch_add(1, memory_order_relaxed);
+				nParsedBytes.fetch_add(mfile.nFileSize, memory_order_relaxed);
+			}
+		};
 
-	struct instrument_bell8 : public instrument_base
+		vector<thread> vecThreads;
+		for (int t = 1; t < nThreads; t++)
+			vecThreads.emplace_back(worker);
+		worker();
+		for (auto &t : vecThreads)
+			t.join();
+
+		nParsed = nParsedFiles;
+		nBytesParsed = nParsedBytes;
+	}
+
+	// Index layout: "MIDX", entry count, then per file its midi_summary
+	// followed by its path in UTF-16
+	bool write_index(const wstring &sFilename) const
 	{
-		instrument_bell8()
-		{
-			env.dAttackTime = 0.01;
-			env.dDecayTime = 0.5;
-			env.dSustainAmplitude = 0.8;
-			env.dReleaseTime = 1.0;
+		ofstream fs(filesystem::path(sFilename), ios::binary);
+		if (!fs.is_open())
+			return false;
 
-			dVolume = 1.0;
+		unsigned int nHeader[2] = { 0x5844494D, (unsigned int)vecFiles.size() };
+		fs.write((const char*)nHeader, sizeof(nHeader));
+		for (size_t i = 0; i < vecFiles.size(); i++)
+		{
+			vector<char16_t> vecPath(vecFiles[i].begin(), vecFiles[i].end());
+			midi_summary s = vecSummaries[i];
+			s.nPathLength = (unsigned short)vecPath.size();
+			fs.write((const char*)&s, sizeof(s));
+			fs.write((const char*)vecPath.data(), vecPath.size() * sizeof(char16_t));
 		}
+		return fs.good();
+	}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+	bool read_index(const wstring &sFilename)
+	{
+		vecFiles.clear();
+		vecSummaries.clear();
+
+		midi_bytes file(sFilename);
+		midi_cursor fs(file.pData, file.nSize);
+		unsigned int nHeader[2];
+		if (fs.remaining() < sizeof(nHeader))
+			return false;
+		memcpy(nHeader, fs.text(sizeof(nHeader)).data(), sizeof(nHeader));
+		if (nHeader[0] != 0x5844494D)
+			return false;
+
+		for (unsigned int i = 0; i < nHeader[1]; i++)
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
+			midi_summary s;
+			string_view sEntry = fs.text(sizeof(s));
+			if (fs.bOverrun)
+				break;
+			memcpy(&s, sEntry.data(), sizeof(s));
+
+			string_view sPath = fs.text(s.nPathLength * sizeof(char16_t));
+			if (fs.bOverrun)
+				break;
+			wstring sFile(s.nPathLength, L' ');
+			for (int c = 0; c < s.nPathLength; c++)
+				sFile[c] = (wchar_t)((unsigned char)sPath[c * 2] | ((unsigned char)sPath[c * 2 + 1] << 8));
+
+			vecFiles.push_back(sFile);
+			vecSummaries.push_back(s);
+		}
+		return !fs.bOverrun;
+	}
+};
 
-			FTYPE dSound =
-				+1.00 * synth::osc(dTime - n.on, synth::scale(n.id), synth::OSC_SQUARE, 5.0, 0.001)
-				+ 0.50 * synth::osc(dTime - n.on, synth::scale(n.id + 12))
-				+ 0.25 * synth::osc(dTime - n.on, synth::scale(n.id + 24));
+// The noise maker asks for one sample per channel at a time, so the synth
+// renders a block ahead and hands it out sample by sample
+const int nOutputChannels = 2;
+const int nBlockFrames = 64;
+SAMPLE dBlockMix[nBlockFrames];
+SAMPLE dVoiceBlock[nBlockFrames];
+int nBlockCursor = nBlockFrames;
 
-			return dAmplitude * dSound * dVolume;
-		}
+// Applies a sequencer event to the voices. Only ever runs on the audio thread.
+void ApplyEvent(const synth::event &e)
+{
+	synth::instrument_base<SAMPLE> *pInstrument = ChannelInstrument(e.nChannel);
+	if (pInstrument == nullptr)
+		return;
 
-	};
+	if (e.nType != synth::EVENT_CONTROL)
+		bNoteHeld[e.nData1 & 127].store(e.nType == synth::EVENT_NOTE_ON, memory_order_relaxed);
 
-	struct instrument_harmonica : public instrument_base
+	synth::voice<SAMPLE> *pVoice = voices.find(e.nChannel, e.nData1);
+	switch (e.nType)
 	{
-		instrument_harmonica()
+	case synth::EVENT_NOTE_ON:
+		if (pVoice == nullptr)
+			pVoice = voices.allocate(e.nChannel, e.nData1);
+		if (pVoice != nullptr)
 		{
-			env.dAttackTime = 0.05;
-			env.dDecayTime = 1.0;
-			env.dSustainAmplitude = 0.95;
-			env.dReleaseTime = 0.1;
-
-			dVolume = 1.0;
+			pInstrument->note_on(*pVoice);
+			voices.start(*pVoice, ChannelGain(e.nChannel));
 		}
+		break;
+
+	case synth::EVENT_NOTE_OFF:
+		if (pVoice != nullptr)
+			pInstrument->note_off(*pVoice);
+		break;
+
+	case synth::EVENT_CONTROL:
+		// All Notes Off
+		if (e.nData1 == 123)
+			for (int i = 0; i < voices.active(); i++)
+				if (voices[i].channel == e.nChannel)
+					pInstrument->note_off(voices[i]);
+		break;
+	}
+}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+void RenderBlock()
+{
+	const long long nBlockStart = nSampleClock.load(memory_order_relaxed);
+	const long long nBlockEnd = nBlockStart + nBlockFrames;
+
+	for (int n = 0; n < nBlockFrames; n++)
+		dBlockMix[n] = 0.0;
+
+	// Split the block at each event's timestamp, so that every event takes
+	// effect on its exact sample. Late events apply at the start of the block.
+	// Events come from the song and from the live queue.
+	int n = 0;
+	synth::event e;
+	while (n < nBlockFrames)
+	{
+		const long long nNow = nBlockStart + n;
+		while (queueEvents.peek(e) && e.nTime <= nNow)
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
-
-			FTYPE dSound =
-				//+ 1.0  * synth::osc(n.on - dTime, synth::scale(n.id-12), synth::OSC_SAW_ANA, 5.0, 0.001, 100)
-				+ 1.00 * synth::osc(dTime - n.on, synth::scale(n.id), synth::OSC_SQUARE, 5.0, 0.001)
-				+ 0.50 * synth::osc(dTime - n.on, synth::scale(n.id + 12), synth::OSC_SQUARE)
-				+ 0.05  * synth::osc(dTime - n.on, synth::scale(n.id + 24), synth::OSC_NOISE);
-
-			return dAmplitude * dSound * dVolume;
+			queueEvents.pop(e);
+			ApplyEvent(e);
 		}
+		while (song.next() <= nNow)
+			ApplyEvent(song.take());
 
-	};
-	
-}
+		long long nNext = song.next();
+		if (queueEvents.peek(e))
+			nNext = min(nNext, e.nTime);
 
-vector<synth::note> vecNotes;
-mutex muxNotes;
-synth::instrument_bell instBell;
-synth::instrument_harmonica instHarm;
+		int nRun = nBlockFrames - n;
+		if (nNext < nBlockEnd)
+			nRun = (int)(nNext - nNow);
 
+		workers.render(dBlockMix + n, nRun);
+		n += nRun;
+	}
+
+	voices.collect();
+	nSampleClock.store(nBlockEnd, memory_order_release);
+}
 
+// Live MIDI from outside the program, such as a pipe or a virtual port. Bytes
+// can arrive in any size of piece. Only one thread may feed it. Messages are
+// stamped for the start of the next block to be rendered.
+midi_stream streamLive;
 
-typedef bool(*lambda)(synth::note const& item);
-template<class T>
-void safe_remove(T &v, lambda f)
+void LiveMidiInput(const unsigned char *pBytes, size_t nBytes)
 {
-	auto n = v.begin();
-	while (n != v.end())
-		if (!f(*n))
-			n = v.erase(n);
+	const long long nNow = nSampleClock.load(memory_order_acquire);
+	streamLive.push(pBytes, nBytes, nNow, [](const midi_message &m)
+	{
+		synth::event e;
+		e.nTime = m.nTick;
+		e.nChannel = m.channel();
+		e.nData1 = m.nData1;
+		e.nData2 = m.nData2;
+		if (m.note_on())
+			e.nType = synth::EVENT_NOTE_ON;
+		else if (m.note_off())
+			e.nType = synth::EVENT_NOTE_OFF;
+		else if (m.type() == MIDI_CONTROL)
+			e.nType = synth::EVENT_CONTROL;
 		else
-			++n;
+			return;
+		queueEvents.push(e);
+	});
 }
 
-#define SWAP32(n) (((n>>24)&0xff) | ((n << 8) & 0xff0000) | ((n >> 8) & 0xff00) | ((n << 24) & 0xff000000))
-#define SWAP16(n) ((n >> 8) | (n << 8))
-struct midifile
-{
+// Function used by olcNoiseMaker to generate sound waves
+// Returns amplitude (-1.0 to +1.0) as a function of time
+FTYPE MakeNoise(int nChannel, FTYPE dTime)
+{	
+	if (nChannel == 0 && nBlockCursor >= nBlockFrames)
+	{
+		RenderBlock();
+		nBlockCursor = 0;
+	}
 
-	struct midievent
+	FTYPE dMixedOutput = (FTYPE)dBlockMix[nBlockCursor];
+	if (nChannel == nOutputChannels - 1)
+		nBlockCursor++;
+
+	return dMixedOutput * 0.2;
+}
+
+#ifdef SYNTH_BENCHMARK
+// Renders a lane group of each instrument through the voice pool and through
+// instrument_base::render(), the double precision reference built from the
+// same recipe(), across attack, sustain and release. Square partials flip a
+// sample early or late wherever the float and double phases straddle an edge;
+// those samples are counted and must stay rare, and everything else must
+// match closely. Returns false if any instrument drifts.
+bool CheckVoiceLanes()
+{
+	const int nBlocks = 44100 * 2 / nBlockFrames;
+	const double dMaxRMS = 0.01;		// Away from moved edges
+	const double dMaxEdges = 0.002;	// Moved edges per voice per sample
+
+	synth::instrument_bell<SAMPLE> bell;
+	synth::instrument_bell8<SAMPLE> bell8;
+	synth::instrument_harmonica<SAMPLE> harm;
+	synth::instrument_base<SAMPLE> *pInstruments[] = { &bell, &bell8, &harm };
+	const wchar_t *sNames[] = { L"bell", L"bell8", L"harmonica" };
+
+	bool bPass = true;
+	for (int i = 0; i < 3; i++)
 	{
-		int nTickDelta;
-		int nChannel;
-		int nNote;
-		int nVelocity;
-		bool bSound;
-		double dRealTime;
-	};
+		synth::instrument_base<SAMPLE> *pInst = pInstruments[i];
+		synth::voice_pool<SAMPLE> pool(synth::SIMD_LANES);
+		vector<synth::voice<SAMPLE>*> vecLanes;
+		vector<synth::voice<SAMPLE>> vecReference;
+		for (int k = 0; k < synth::SIMD_LANES; k++)
+		{
+			synth::voice<SAMPLE> *v = pool.allocate(0, 36 + 5 * k);
+			pInst->note_on(*v);
+			pool.start(*v, 1.0);
+			vecLanes.push_back(v);
+			vecReference.push_back(*v);
+		}
 
-	struct midichannel
+		double dErrorSquared = 0.0, dMaxError = 0.0;
+		int nEdges = 0;
+		for (int b = 0; b < nBlocks; b++)
+		{
+			if (b == nBlocks / 2)
+				for (int k = 0; k < synth::SIMD_LANES; k++)
+				{
+					pInst->note_off(*vecLanes[k]);
+					pInst->note_off(vecReference[k]);
+				}
+
+			SAMPLE dReference[nBlockFrames] = {};
+			for (auto &v : vecReference)
+			{
+				pInst->render(v, dVoiceBlock, nBlockFrames);
+				for (int n = 0; n < nBlockFrames; n++)
+					dReference[n] += dVoiceBlock[n];
+			}
+
+			for (int n = 0; n < nBlockFrames; n++)
+				dBlockMix[n] = 0;
+			pool.render(dBlockMix, nBlockFrames);
+
+			for (int n = 0; n < nBlockFrames; n++)
+			{
+				double dError = fabs((double)dBlockMix[n] - (double)dReference[n]);
+				dMaxError = max(dMaxError, dError);
+				if (dError > 0.1)
+					nEdges++;
+				else
+					dErrorSquared += dError * dError;
+			}
+		}
+
+		const int nSamples = nBlocks * nBlockFrames;
+		double dRMS = sqrt(dErrorSquared / (nSamples - nEdges));
+		bool bOK = dRMS < dMaxRMS && nEdges < dMaxEdges * nSamples * synth::SIMD_LANES;
+		bPass &= bOK;
+		wcout << L"voice lanes vs reference: " << sNames[i] << L" x " << synth::SIMD_LANES << L"  max error " << dMaxError
+			<< L"  RMS " << dRMS << L"  square edges moved " << nEdges << (bOK ? L"  ok" : L"  FAILED") << endl;
+	}
+	return bPass;
+}
+
+// Plays a small two channel timeline through a loop and then a seek, and
+// checks every event comes out in order, at the right time, with an All Notes
+// Off burst wherever playback jumps. Returns false, and says where, if not.
+bool CheckSequencer()
+{
+	using namespace synth;
+
+	timeline t;
+	t.push({ 0, EVENT_NOTE_ON, 0, 60, 100 });
+	t.push({ 100, EVENT_NOTE_ON, 1, 64, 100 });
+	t.push({ 200, EVENT_NOTE_OFF, 0, 60, 0 });
+	t.push({ 300, EVENT_NOTE_OFF, 1, 64, 0 });
+
+	sequencer seq;
+	seq.load(t);
+	vector<event> vecHeard;
+	auto play = [&](long long nUntil)
 	{
-		list<midievent> listEvents;
-		double dLastEventTime;
+		while (seq.next() <= nUntil)
+			vecHeard.push_back(seq.take());
 	};
 
+	// Start at 1000 looping [100, 300), then seek to 250 at 2000 with the loop off
+	seq.start(1000);
+	seq.loop(100, 300);
+	play(1450);
+	seq.loop(0, 0);
+	seq.start(2000, 250);
+	play(LLONG_MAX - 1);
 
-	list<midichannel> listChannels;
+	const event eExpected[] =
+	{
+		{ 1000, EVENT_CONTROL, 1, 123, 0 }, { 1000, EVENT_CONTROL, 0, 123, 0 },
+		{ 1000, EVENT_NOTE_ON, 0, 60, 100 },
+		{ 1100, EVENT_NOTE_ON, 1, 64, 100 },
+		{ 1200, EVENT_NOTE_OFF, 0, 60, 0 },
+		{ 1300, EVENT_CONTROL, 1, 123, 0 }, { 1300, EVENT_CONTROL, 0, 123, 0 },	// Loop
+		{ 1300, EVENT_NOTE_ON, 1, 64, 100 },
+		{ 1400, EVENT_NOTE_OFF, 0, 60, 0 },
+		{ 2000, EVENT_CONTROL, 1, 123, 0 }, { 2000, EVENT_CONTROL, 0, 123, 0 },	// Seek
+		{ 2050, EVENT_NOTE_OFF, 1, 64, 0 },
+	};
+	const size_t nExpected = sizeof(eExpected) / sizeof(eExpected[0]);
 
-	midifile(wstring sFilename)
+	for (size_t i = 0; i < max(nExpected, vecHeard.size()); i++)
 	{
-		ifstream fs;
-		fs.open(sFilename, fstream::in | ios::binary);
-		if (!fs.is_open())
-			return;
+		if (i >= nExpected || i >= vecHeard.size())
+		{
+			wcout << L"sequencer: expected " << nExpected << L" events, heard " << vecHeard.size() << L"  FAILED" << endl;
+			return false;
+		}
 
-		unsigned int nFileID;
-		unsigned int nHeaderLength;
-		unsigned short nFormat;
-		unsigned short nTrackChunks;
-		unsigned short nDivision;
-		
+		const event &a = vecHeard[i], &b = eExpected[i];
+		if (a.nTime != b.nTime || a.nType != b.nType || a.nChannel != b.nChannel || a.nData1 != b.nData1 || a.nData2 != b.nData2)
+		{
+			wcout << L"sequencer: event " << i << L" was type " << a.nType << L" channel " << a.nChannel << L" data " << a.nData1
+				<< L" at " << a.nTime << L", expected type " << b.nType << L" channel " << b.nChannel << L" data " << b.nData1
+				<< L" at " << b.nTime << L"  FAILED" << endl;
+			return false;
+		}
+	}
 
-		fs.read((char*)&nFileID, sizeof(unsigned int)); 
-		nFileID = SWAP32(nFileID);
-		fs.read((char*)&nHeaderLength, sizeof(unsigned int));
-		nHeaderLength = SWAP32(nHeaderLength);
-		fs.read((char*)&nFormat, sizeof(unsigned short));
-		nFormat = SWAP16(nFormat);
-		fs.read((char*)&nTrackChunks, sizeof(unsigned short));
-		nTrackChunks = SWAP16(nTrackChunks);
-		fs.read((char*)&nDivision, sizeof(unsigned short));
-		nDivision = SWAP16(nDivision);
-		
-		
+	wcout << L"sequencer: " << nExpected << L" events through a loop and a seek  ok" << endl;
+	return true;
+}
 
-		for (int chunk = 0; chunk < nTrackChunks; chunk++)
-		{
-			unsigned int nTrackID, nTrackLength;
-			fs.read((char*)&nTrackID, sizeof(unsigned int));
-			nTrackID = SWAP32(nTrackID);
-			fs.read((char*)&nTrackLength, sizeof(unsigned int));
-			nTrackLength = SWAP32(nTrackLength);
+// Renders the same held voices through the per-sample sound() path and the
+// block render() path, and reports how long each takes
+void BenchmarkInstruments()
+{
+	const int nVoices = 32;
+	const int nSeconds = 4;
+	const int nFrames = 44100 * nSeconds;
 
-			int length;
-			bool bTrack = true;
+	synth::instrument_bell<SAMPLE> bell;
+	synth::instrument_bell8<SAMPLE> bell8;
+	synth::instrument_harmonica<SAMPLE> harm;
+	synth::instrument_base<SAMPLE> *pInstruments[] = { &bell, &bell8, &harm };
+	const wchar_t *sNames[] = { L"bell", L"bell8", L"harmonica" };
 
-			double dRealTime = 0.0;
-			midichannel channel;
-			channel.dLastEventTime = 0.0;
+	for (int i = 0; i < 3; i++)
+	{
+		synth::instrument_base<SAMPLE> *pInst = pInstruments[i];
+		volatile double dSink = 0.0;
 
-			auto readtext = [&]()
-			{
-				string s;				
-				for (int i = 0; i < length; i++)
-					s += (char)fs.get();
-				return s;
-			};
+		auto tp1 = chrono::high_resolution_clock::now();
+		for (int k = 0; k < nVoices; k++)
+		{
+			synth::note n;
+			n.id = 48 + k;
+			n.on = 0.0;
+			n.off = -1.0;
+			bool bFinished = false;
+			for (int s = 0; s < nFrames; s++)
+				dSink = dSink + pInst->sound(s * pInst->dTimeStep, n, bFinished);
+		}
+		auto tp2 = chrono::high_resolution_clock::now();
 
-			while (!fs.eof() && bTrack)
+		for (int k = 0; k < nVoices; k++)
+		{
+			synth::voice<SAMPLE> v;
+			v.id = 48 + k;
+			pInst->note_on(v);
+			for (int s = 0; s < nFrames; s += nBlockFrames)
 			{
-				unsigned int nEventDelta = read_var(fs);
-				unsigned char nEventStatus = fs.get();
+				pInst->render(v, dVoiceBlock, nBlockFrames);
+				dSink = dSink + dVoiceBlock[0];
+			}
+		}
+		auto tp3 = chrono::high_resolution_clock::now();
 
-				dRealTime += (double)nEventDelta;
+		double dPerSample = chrono::duration<double>(tp2 - tp1).count();
+		double dBlock = chrono::duration<double>(tp3 - tp2).count();
+		wcout << sNames[i] << L": " << nVoices << L" voices x " << nSeconds << L"s  sound(): " << dPerSample
+			<< L"s  render(): " << dBlock << L"s  speedup: " << dPerSample / dBlock << L"x" << endl;
+	}
+}
 
-				if (nEventStatus == 0xF0)
-				{
-					length = read_var(fs);
-					wcout << "SysEx1: " << readtext().c_str() << endl;
-				}
+// Renders a dense chord of held voices one voice at a time and then
+// SIMD_LANES voices at a time, and reports how many voices each could
+// sustain in real time on one core
+void BenchmarkVoiceLanes()
+{
+	const int nVoices = 256;
+	const int nSeconds = 2;
+	const int nFrames = 44100 * nSeconds;
 
-				if (nEventStatus == 0xF7)
-				{
-					length = read_var(fs);
-					wcout << "SysEx2: " << readtext().c_str() << endl;
-				}
+	synth::instrument_bell8<SAMPLE> bell8;
+	synth::voice_pool<SAMPLE> pool(nVoices);
+	for (int k = 0; k < nVoices; k++)
+	{
+		synth::voice<SAMPLE> *v = pool.allocate(k % synth::POOL_CHANNELS, 24 + k / synth::POOL_CHANNELS);
+		bell8.note_on(*v);
+		pool.start(*v, 1.0);
+	}
 
-				if (nEventStatus == 0xFF)
-				{
-					int id = fs.get();
-					switch (id)
-					{
-					case 0x01:
-						length = read_var(fs);
-						wcout << "Text: " << readtext().c_str() << endl;
-						break;
-					case 0x02:
-						length = read_var(fs);
-						wcout << "Copyright: " << readtext().c_str() << endl;
-						break;
-					case 0x03:
-						length = read_var(fs);
-						wcout << "Track Name: " << readtext().c_str() << endl;
-						break;
-					case 0x04: 
-						length = read_var(fs);
-						wcout << "Instrument: " << readtext().c_str() << endl;
-						break;
-					case 0x05: 
-						length = read_var(fs);
-						wcout << "Lyric: " << readtext().c_str() << endl;
-						break;
-					case 0x06:
-						length = read_var(fs);
-						wcout << "Marker: " << readtext().c_str() << endl;
-						break;
-					case 0x07:
-						length = read_var(fs);
-						wcout << "Cue: " << readtext().c_str() << endl;
-						break;
-					case 0x20:
-						wcout << "Prefix: " << fs.get() << " Channel: " << fs.get() << endl;
-						break;
-					case 0x2F:
-						fs.get();
-						wcout << "[END OF TRACK]" << endl;
-						bTrack = false;
-						break;
-					case 0x51:
-						fs.get(); fs.get(); fs.get(); fs.get();
-						wcout << "Set Tempo" << endl;
-						break;
-					case 0x54:
-						fs.get();
-						wcout << "SMPTE Offset: H:" << fs.get() << " M:" << fs.get() << " S:" << fs.get() << " FR:" << fs.get() << " FF:" << fs.get() << endl;
-						break;
-					case 0x58:
-						fs.get();
-						wcout << "Time Signature: " << fs.get() << "/" << ( fs.get()) << " ClocksPerTick: " << fs.get() << " 32per24Clocks: " << fs.get() << endl;
-						break;
-					case 0x59:
-						fs.get();
-						wcout << "Key Signature: " << fs.get() << " Minor Key: " << fs.get() << endl;
-						break;
-					case 0x40:
-						fs.get();
-						wcout << "Odd Code" << endl;
-						break;
-
-					default:
-						wcout << "Unknown Event: " << id << endl;
-					}
-				}
-				
-				if (nEventStatus >= 0x80 && nEventStatus < 0x90)
-				{
-					// MIDI Note Off
-					unsigned char nNoteID = fs.get();
-					unsigned char nNoteVel = fs.get();
-					wcout << "[NOTE OFF] Channel: " << nEventStatus-0x80 << " Delta: " << nEventDelta << " Note: " << nNoteID << " Vel: " << nNoteVel << endl;
+	auto tp1 = chrono::high_resolution_clock::now();
+	for (int s = 0; s < nFrames; s += nBlockFrames)
+		for (int k = 0; k < nVoices; k++)
+			bell8.render(pool[k], dVoiceBlock, nBlockFrames);
+	auto tp2 = chrono::high_resolution_clock::now();
+	for (int s = 0; s < nFrames; s += nBlockFrames)
+		pool.render(dBlockMix, nBlockFrames);
+	auto tp3 = chrono::high_resolution_clock::now();
+
+	double dPerVoice = chrono::duration<double>(tp2 - tp1).count();
+	double dLanes = chrono::duration<double>(tp3 - tp2).count();
+	wcout << L"voice lanes (" << synth::SIMD_LANES << L" wide): " << nVoices << L" voices x " << nSeconds << L"s  per voice: " << dPerVoice
+		<< L"s (" << (int)(nVoices * nSeconds / dPerVoice) << L" voices/core)  lanes: " << dLanes
+		<< L"s (" << (int)(nVoices * nSeconds / dLanes) << L" voices/core)" << endl;
+}
 
-					if (nNoteID == 72 && nNoteVel == 64 && nEventDelta == 14)
-					{
-						int j = 0;
-					}
+// Renders a voice on every (channel, note) key with 1 to N threads, checking
+// that every thread count produces exactly the same mix
+void BenchmarkVoiceThreads()
+{
+	const int nVoices = synth::POOL_CHANNELS * synth::POOL_NOTES;
+	const int nBlocks = 44100 * 2 / nBlockFrames;
+	const int nMaxThreads = max(1u, thread::hardware_concurrency());
 
-					midievent e;
-					e.nTickDelta = nEventDelta;
-					e.nNote = nNoteID;
-					e.nVelocity = nNoteVel;
-					e.bSound = false;
-					e.dRealTime = dRealTime;
-					channel.listEvents.push_back(e);
-				}
-				
-				if (nEventStatus >= 0x90 && nEventStatus < 0xA0)
-				{
-					// MIDI Note ON
-					unsigned char nNoteID = fs.get();
-					unsigned char nNoteVel = fs.get();
-					wcout << "[NOTE ON ] Channel: " << nEventStatus - 0x90 << " Delta: " << nEventDelta << " Note: " << nNoteID << " Vel: " << nNoteVel << endl;
-					
-					midievent e;
-					e.nTickDelta = nEventDelta;
-					e.nNote = nNoteID;
-					e.nVelocity = nNoteVel;
-					e.bSound = true;
-					e.dRealTime = dRealTime;
-					channel.listEvents.push_back(e);
-				}
+	vector<SAMPLE> vecReference;
+	for (int nThreads = 1; nThreads <= nMaxThreads; nThreads *= 2)
+	{
+		synth::instrument_bell8<SAMPLE> bell8;
+		synth::voice_pool<SAMPLE> pool(nVoices);
+		synth::voice_workers<SAMPLE> team(pool);
+		vector<synth::voice<SAMPLE>*> vecVoices;
+		for (int k = 0; k < nVoices; k++)
+		{
+			synth::voice<SAMPLE> *v = pool.allocate(k % synth::POOL_CHANNELS, k / synth::POOL_CHANNELS);
+			bell8.note_on(*v);
+			pool.start(*v, 1.0);
+			vecVoices.push_back(v);
+		}
 
-				if (nEventStatus >= 0xA0 && nEventStatus < 0xB0)
-				{
-					// MIDI Polyphonic Aftertouch
-					unsigned char nNoteID = fs.get();
-					unsigned char nNoteVel = fs.get();
-					wcout << "[POLYPHON] Channel: " << nEventStatus - 0xA0 << " Delta: " << nEventDelta << " Note: " << nNoteID << " Pressure: " << nNoteVel << endl;
-				}
+		// Every voice must still be reachable by its key, or note-offs would miss it
+		int nLost = 0;
+		for (int k = 0; k < nVoices; k++)
+			if (pool.find(k % synth::POOL_CHANNELS, k / synth::POOL_CHANNELS) != vecVoices[k])
+				nLost++;
+		if (nLost > 0)
+		{
+			wcout << L"voice threads: " << nLost << L" of " << nVoices << L" voices not found by key" << endl;
+			return;
+		}
 
-				if (nEventStatus >= 0xB0 && nEventStatus < 0xC0)
-				{
-					// MIDI Control
-					unsigned char nCommand = fs.get();
-					unsigned char nParam = fs.get();
-					wcout << "[CONTROL ] Channel: " << nCommand - 0xB0 << " Delta: " << nEventDelta << " Command: " << nCommand << " Param: " << nParam << endl;
-				}
+		team.start(nThreads);
 
-				if (nEventStatus >= 0xC0 && nEventStatus < 0xD0)
-				{
-					// MIDI Control
-					unsigned char nCommand = fs.get();
-					//unsigned char nParam = fs.get();
-					//wcout << "[PROGRAM ] Channel: " << nCommand - 0xC0 << " Delta: " << nEventDelta << " Command: " << nCommand << " Param: " << nParam << endl;
-				}
+		vector<SAMPLE> vecMix(nBlocks * nBlockFrames, 0.0);
+		auto tp1 = chrono::high_resolution_clock::now();
+		for (int b = 0; b < nBlocks; b++)
+			team.render(&vecMix[b * nBlockFrames], nBlockFrames);
+		auto tp2 = chrono::high_resolution_clock::now();
+		team.stop();
 
-				if (nEventStatus >= 0xD0 && nEventStatus < 0xE0)
-				{
-					// MIDI Control
-					unsigned char nCommand = fs.get();
-					//unsigned char nParam = fs.get();
-					//wcout << "[AFTER P ] Channel: " << nCommand - 0xD0 << " Delta: " << nEventDelta << " Command: " << nCommand << " Param: " << nParam << endl;
-				}
+		if (nThreads == 1)
+			vecReference = vecMix;
 
-				if (nEventStatus >= 0xE0 && nEventStatus < 0xF0)
-				{
-					// MIDI Control
-					unsigned char nCommand = fs.get();
-					unsigned char nParam = fs.get();
-					wcout << "[PITCH WH] Channel: " << nCommand - 0xE0 << " Delta: " << nEventDelta << " Command: " << nCommand << " Param: " << nParam << endl;
-				}
+		double dTime = chrono::duration<double>(tp2 - tp1).count();
+		wcout << L"voice threads: " << nThreads << L" x " << nVoices << L" voices  " << dTime << L"s  ("
+			<< (int)(nVoices * 2.0 / dTime) << L" voices in real time)  "
+			<< (vecMix == vecReference ? L"identical" : L"DIFFERENT") << endl;
+	}
+}
+
+// Renders one second of each instrument in float and in double. The voice
+// pool is left out: its lanes are float for either sample type.
+template<typename T>
+double TimeSampleType()
+{
+	const int nVoices = 64;
+	const int nFrames = 44100;
+	T dBlock[nBlockFrames];
+
+	synth::instrument_bell<T> bell;
+	synth::instrument_bell8<T> bell8;
+	synth::instrument_harmonica<T> harm;
+	synth::instrument_base<T> *pInstruments[] = { &bell, &bell8, &harm };
+
+	auto tp1 = chrono::high_resolution_clock::now();
+	for (auto pInst : pInstruments)
+		for (int k = 0; k < nVoices; k++)
+		{
+			synth::voice<T> v;
+			v.id = 36 + k;
+			pInst->note_on(v);
+			for (int s = 0; s < nFrames; s += nBlockFrames)
+				pInst->render(v, dBlock, nBlockFrames);
+		}
+	auto tp2 = chrono::high_resolution_clock::now();
+
+	return chrono::duration<double>(tp2 - tp1).count();
+}
 
+void BenchmarkSampleTypes()
+{
+	double dFloat = TimeSampleType<float>();
+	double dDouble = TimeSampleType<double>();
+	wcout << L"sample type: instruments float " << dFloat << L"s double " << dDouble << L"s ("
+		<< dDouble / dFloat << L"x)" << endl;
+}
 
+// Parses every .mid file in the working folder repeatedly, silently, and
+// reports the parser's throughput
+void BenchmarkMidiParser()
+{
+	const int nPasses = 20;
 
-			}
+	vector<wstring> vecFiles;
+	for (auto &entry : filesystem::directory_iterator(L"."))
+		if (entry.path().extension() == L".mid")
+			vecFiles.push_back(entry.path().wstring());
+	if (vecFiles.empty())
+	{
+		wcout << L"midi parser: no .mid files in the working folder" << endl;
+		return;
+	}
 
-			listChannels.push_back(channel);
+	size_t nBytes = 0, nEvents = 0;
+	auto tp1 = chrono::high_resolution_clock::now();
+	for (int p = 0; p < nPasses; p++)
+		for (auto &sFile : vecFiles)
+		{
+			midifile mfile(sFile);
+			nBytes += mfile.nFileSize;
+			for (auto &channel : mfile.vecChannels)
+				nEvents += channel.vecEvents.size();
 		}
+	auto tp2 = chrono::high_resolution_clock::now();
 
-		fs.close();
+	double dTime = chrono::duration<double>(tp2 - tp1).count();
+	wcout << L"midi parser: " << vecFiles.size() << L" files x " << nPasses << L"  " << nBytes / 1048576.0 << L"MB  "
+		<< nEvents << L" note events  " << dTime << L"s  (" << nBytes / 1048576.0 / dTime << L" MB/s)" << endl;
+}
 
+// Loads every .mid file under the working folder across all cores, writes an
+// index of them to the temp folder, then loads again through the index, which
+// should skip them all
+void BenchmarkMidiCorpus()
+{
+	vector<wstring> vecFiles;
+	for (auto &entry : filesystem::recursive_directory_iterator(L"."))
+		if (entry.path().extension() == L".mid")
+			vecFiles.push_back(entry.path().wstring());
+	if (vecFiles.empty())
+	{
+		wcout << L"midi corpus: no .mid files under the working folder" << endl;
+		return;
 	}
 
-	unsigned int read_var(ifstream &fs)
+	const int nThreads = max(1u, thread::hardware_concurrency());
+	midi_corpus corpus;
+	auto tp1 = chrono::high_resolution_clock::now();
+	corpus.load(vecFiles, nThreads, false);
+	auto tp2 = chrono::high_resolution_clock::now();
+	const filesystem::path pathIndex = filesystem::temp_directory_path() / L"corpus.idx";
+	corpus.write_index(pathIndex.wstring());
+
+	midi_corpus indexed;
+	indexed.read_index(pathIndex.wstring());
+	auto tp3 = chrono::high_resolution_clock::now();
+	indexed.load(vecFiles, nThreads, false);
+	auto tp4 = chrono::high_resolution_clock::now();
+	error_code ec;
+	filesystem::remove(pathIndex, ec);
+
+	long long nNotes = 0;
+	int nPolyphony = 0;
+	for (auto &s : corpus.vecSummaries)
 	{
-		unsigned int value = 0;
-		unsigned char c = 0;
+		nNotes += s.nNotes;
+		nPolyphony = max(nPolyphony, (int)s.nPolyphony);
+	}
 
-		
-		value = fs.get();
+	double dTime = chrono::duration<double>(tp2 - tp1).count();
+	wcout << L"midi corpus: " << corpus.nParsed << L" files on " << nThreads << L" threads  " << dTime << L"s  ("
+		<< corpus.nParsed / dTime << L" files/s, " << corpus.nBytesParsed / 1048576.0 / dTime << L" MB/s)  "
+		<< nNotes << L" notes, peak polyphony " << nPolyphony << endl;
+	wcout << L"midi corpus from index: " << vecFiles.size() - indexed.nParsed << L" of " << vecFiles.size() << L" files skipped  "
+		<< chrono::duration<double>(tp4 - tp3).count() << L"s" << endl;
+}
 
-		if (value == 0x92)
-		{
-			int i = 0;
-		};
+// Plays notes in through the live MIDI input while a stand-in audio thread
+// renders blocks in real time, and times each note from its last byte arriving
+// to its first non-silent block. The sound card's own buffering comes on top.
+void BenchmarkMidiLatency()
+{
+	const int nNotes = 20;
+	const auto tBlock = chrono::nanoseconds(1000000000LL * nBlockFrames / 44100);
 
-		if (value & 0x80)
+	atomic<bool> bQuit(false);
+	atomic<long long> nArrival(-1), nOnset(-1);
+	thread audio([&]()
+	{
+		auto tNext = chrono::steady_clock::now();
+		while (!bQuit)
 		{
-			value &= 0x7F;
-			do
-			{
-				c = fs.get();
-				value = (value << 7) + (c & 0x7F);
-			}
-			while (c & 0x80);
+			this_thread::sleep_until(tNext += tBlock);
+			RenderBlock();
+
+			bool bSound = false;
+			for (int n = 0; n < nBlockFrames; n++)
+				bSound |= dBlockMix[n] != 0;
+			if (bSound && nArrival >= 0 && nOnset < 0)
+				nOnset = chrono::steady_clock::now().time_since_epoch().count();
 		}
-		return value;
-	}
-};
-
-
-// Function used by olcNoiseMaker to generate sound waves
-// Returns amplitude (-1.0 to +1.0) as a function of time
-FTYPE MakeNoise(int nChannel, FTYPE dTime)
-{	
-	unique_lock<mutex> lm(muxNotes);
-	FTYPE dMixedOutput = 0.0;
+	});
 
-	for (auto &n : vecNotes)
+	double dTotal = 0.0, dWorst = 0.0;
+	for (int k = 0; k < nNotes; k++)
 	{
-		bool bNoteFinished = false;
-		FTYPE dSound = 0;
-		if(n.channel == 2)
-			dSound = instBell.sound(dTime, n, bNoteFinished);
-		if (n.channel == 1)
-			dSound = instHarm.sound(dTime, n, bNoteFinished) * 0.5;
-		dMixedOutput += dSound;
-
-		if (bNoteFinished && n.off > n.on)
-			n.active = false;
+		// Note On for the harmonica, split over two reads, then a Note Off
+		// by running status once it has sounded
+		const unsigned char nStatus[] = { 0x91, (unsigned char)(60 + k) };
+		const unsigned char nVelocity[] = { 100 };
+		const unsigned char nOff[] = { (unsigned char)(60 + k), 0 };
+
+		nOnset = -1;
+		LiveMidiInput(nStatus, sizeof(nStatus));
+		this_thread::sleep_for(chrono::milliseconds(1));
+		nArrival = chrono::steady_clock::now().time_since_epoch().count();
+		LiveMidiInput(nVelocity, sizeof(nVelocity));
+
+		while (nOnset < 0)
+			this_thread::sleep_for(chrono::microseconds(100));
+		double dLatency = chrono::duration<double, milli>(chrono::steady_clock::duration(nOnset - nArrival)).count();
+		dTotal += dLatency;
+		dWorst = max(dWorst, dLatency);
+
+		nArrival = -1;
+		LiveMidiInput(nOff, sizeof(nOff));
+		this_thread::sleep_for(chrono::milliseconds(250));
 	}
 
-	// Woah! Modern C++ Overload!!!
-	safe_remove<vector<synth::note>>(vecNotes, [](synth::note const& item) { return item.active; });
-
-
-	return dMixedOutput * 0.2;
+	bQuit = true;
+	audio.join();
+	wcout << L"midi latency: " << nNotes << L" notes  mean " << dTotal / nNotes << L"ms  worst " << dWorst
+		<< L"ms  (block " << nBlockFrames * 1000.0 / 44100.0 << L"ms)" << endl;
 }
+#endif
 
-int main()
+int main(int argc, char *argv[])
 {
+#ifdef SYNTH_BENCHMARK
+	if (!CheckVoiceLanes() || !CheckSequencer())
+		return 1;
+	BenchmarkInstruments();
+	BenchmarkVoiceLanes();
+	BenchmarkVoiceThreads();
+	BenchmarkSampleTypes();
+	BenchmarkMidiParser();
+	BenchmarkMidiCorpus();
+	BenchmarkMidiLatency();
+	return 0;
+#endif
+
 
 	midifile mfile(L"test1.mid");
 
@@ -638,6 +2874,9 @@ int main()
 	for (auto d : devices) wcout << "Found Output Device: " << d << endl;
 	wcout << "Using Device: " << devices[0] << endl;
 
+	const int nRenderThreads = RenderThreads(argc, argv);
+	wcout << "Render Threads: " << nRenderThreads << endl;
+
 	// Display a keyboard
 	wcout << endl <<
 		"|   |   |   |   |   | |   |   |   |   | |   | |   |   |   |" << endl <<
@@ -653,7 +2892,12 @@ int main()
 	// Create sound machine!!
 	olcNoiseMaker<short> sound(devices[0], 44100, 2, 24, 1024);
 
+	// Queue up the song to start as soon as the synth begins
+	song.load(BuildTimeline(mfile));
+	song.start(0);
+
 	// Link noise function with sound machine
+	workers.start(nRenderThreads);
 	sound.SetUserFunction(MakeNoise);
 
 	//// Sit in loop, capturing keyboard state changes and modify
@@ -679,68 +2923,24 @@ int main()
 	//sKnob *pSelectedKnob = nullptr;
 
 	char keyboard[129];
-	memset(keyboard, ' ', 127);
+	memset(keyboard, ' ', 128);
 	keyboard[128] = '\0';
 
-	auto clock_old_time = chrono::high_resolution_clock::now();
-	auto clock_real_time = chrono::high_resolution_clock::now();
-	double dElapsedTime = 0.0;
-
+	// The audio thread plays the song; this thread just shows which notes
+	// are down a few times a second
 	while (1)
 	{
-		clock_real_time = chrono::high_resolution_clock::now();
-		auto time_last_loop = clock_real_time - clock_old_time;
-		clock_old_time = clock_real_time;
-		dElapsedTime += 280.0 * chrono::duration<double>(time_last_loop).count();
+		this_thread::sleep_for(50ms);
 
 		bool bDisplay = false;
-		int nChannel = 0;
-		//auto channel = mfile.listChannels.back();
-		for (auto &channel : mfile.listChannels)
+		for (int k = 0; k < 128; k++)
 		{
-			if (channel.listEvents.size() > 0)
+			char c = bNoteHeld[k].load(memory_order_relaxed) ? '#' : ' ';
+			if (keyboard[k] != c)
 			{
-				muxNotes.lock();
-				auto evt = channel.listEvents.front();
-				while ((evt = channel.listEvents.front()).dRealTime <= dElapsedTime)
-				{
-					auto noteFound = find_if(vecNotes.begin(), vecNotes.end(), [&evt](synth::note const& item) { return item.id == evt.nNote; });
-					if (noteFound == vecNotes.end())
-					{
-						synth::note n;
-						n.channel = nChannel;
-						n.id = evt.nNote;
-						n.on = sound.GetTime();
-						n.active = true;
-						vecNotes.emplace_back(n);
-						keyboard[n.id] = '#';
-						bDisplay = true;
-					}
-					else
-					{
-						// Note is playing
-						if (!evt.bSound)
-						{
-							noteFound->off = sound.GetTime();
-							keyboard[noteFound->id] = ' ';
-							bDisplay = true;
-						}
-						else
-						{
-							//noteFound->off = sound.GetTime();
-							noteFound->on = sound.GetTime();
-							keyboard[noteFound->id] = '#';
-							bDisplay = true;
-						}
-					}
-					channel.listEvents.pop_front();
-					if (channel.listEvents.size() == 0)
-						break;
-				}
-				muxNotes.unlock();
+				keyboard[k] = c;
+				bDisplay = true;
 			}
-
-			nChannel++;
 		}
 
 		if(bDisplay)
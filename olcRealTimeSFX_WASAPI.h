@@ -15,6 +15,8 @@
 
 #pragma comment(lib, "avrt.lib")
 
+#include "olcRealTimeSFX_DSP.h"
+
 
 class olcRealTimeSFX_WASAPI
 {
@@ -56,10 +58,32 @@ private:
     std::atomic<bool>       m_atomActive   = false;
     std::atomic<WAVEHDR*>   m_atomHeaderIn = nullptr;
 
+    // Effects chain, only touched by ThreadProcess
+    sfx::noise_gate         m_gate;
+    sfx::amp_model          m_amp{ sfx::AMP_CRUNCH, 4 };
+    sfx::convolver          m_cabinet{ 128 };
+    sfx::equalizer<4, 1>    m_eq;
+    float                   m_fEQGain[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    sfx::chorus<4>          m_chorus;
+    sfx::flanger            m_flanger;
+    sfx::phaser<6>          m_phaser;
+    int                     m_nModulation = MOD_NONE;
+    sfx::fdn_reverb<8>      m_reverb;
+    sfx::pitch_tracker      m_tuner;
+
+    // Metering of what goes to the device
+    sfx::level_meter        m_meter;
+    sfx::spectrum_analyser  m_spectrum;
+
 public:
+    static const int MOD_NONE    = 0;
+    static const int MOD_CHORUS  = 1;
+    static const int MOD_FLANGER = 2;
+    static const int MOD_PHASER  = 3;
+
     olcRealTimeSFX_WASAPI() 
     {
-
+        m_reverb.fWet = 0.0f;
     }
 
 
@@ -72,6 +96,17 @@ public:
         unsigned nBlockSamples = 512
     ) {
         m_nSampleRate    = nSampleRate;
+        m_eq.set_band(0, sfx::design_biquad(sfx::FILTER_LOWSHELF,  120.0,  0.7071, m_nSampleRate, m_fEQGain[0]), false);
+        m_eq.set_band(1, sfx::design_biquad(sfx::FILTER_PEAK,      500.0,  1.0,    m_nSampleRate, m_fEQGain[1]), false);
+        m_eq.set_band(2, sfx::design_biquad(sfx::FILTER_PEAK,      2000.0, 1.0,    m_nSampleRate, m_fEQGain[2]), false);
+        m_eq.set_band(3, sfx::design_biquad(sfx::FILTER_HIGHSHELF, 5000.0, 0.7071, m_nSampleRate, m_fEQGain[3]), false);
+        m_reverb.set_sample_rate(m_nSampleRate);
+        m_amp.set_sample_rate(m_nSampleRate);
+        m_chorus.set_sample_rate(m_nSampleRate);
+        m_flanger.set_sample_rate(m_nSampleRate);
+        m_phaser.set_sample_rate(m_nSampleRate);
+        m_gate.set_sample_rate(m_nSampleRate);
+        m_meter.set_sample_rate(m_nSampleRate);
         m_nChannels      = nChannels;
         m_nBlockInCount  = nBlocks;
         m_nBlockOutCount = nBlocks;
@@ -325,6 +360,113 @@ public:
     }
 
 
+    // Speaker cabinet, or any impulse response, from a WAV file. Call before
+    // Create(); without one the cabinet stage passes straight through.
+    bool LoadImpulseResponse(const std::wstring &sFilename, float fGain = 1.0f)
+    {
+        return m_cabinet.load_wav(sFilename, fGain);
+    }
+
+
+    // Amp: one of sfx::AMP_CLEAN, AMP_CRUNCH, AMP_LEAD or AMP_FUZZ, with its
+    // drive and tone stack knobs (0 .. 1). Drive 0.5 is the model as voiced;
+    // 0 and 1 are a quarter and four times its own gain. Call before Create().
+    void SetAmp(int nModel, float fDrive = 0.5f, float fBass = 0.5f, float fMid = 0.5f, float fTreble = 0.5f)
+    {
+        m_amp.load_model(nModel);
+        m_amp.set_drive(fDrive);
+        m_amp.set_tone(fBass, fMid, fTreble);
+    }
+
+    // Replaces the amp's transfer curve with one from a text file of
+    // "input output" pairs. Call before Create().
+    bool LoadAmpCurve(const std::wstring &sFilename)
+    {
+        return m_amp.load_curve(sFilename);
+    }
+
+
+    // Tone controls in dB: bass and treble shelves at 120Hz and 5kHz, mid
+    // peaks at 500Hz and 2kHz. Call before Create(); flat by default.
+    void SetEQ(float fBassDB, float fLowMidDB, float fHighMidDB, float fTrebleDB)
+    {
+        m_fEQGain[0] = fBassDB;
+        m_fEQGain[1] = fLowMidDB;
+        m_fEQGain[2] = fHighMidDB;
+        m_fEQGain[3] = fTrebleDB;
+    }
+
+
+    // Algorithmic reverb, off (fWet = 0) by default. Its cost doesn't depend
+    // on fDecay, so long tails are as cheap as short ones. Call before Create().
+    void SetReverb(float fWet, float fDecay = 2.0f, float fDamping = 0.3f)
+    {
+        m_reverb.fWet = fWet;
+        m_reverb.fDecay = fDecay;
+        m_reverb.fDamping = fDamping;
+    }
+
+
+    // Modulation slot, ahead of the reverb: one of MOD_NONE, MOD_CHORUS,
+    // MOD_FLANGER or MOD_PHASER. Call before Create().
+    void SetModulation(int nEffect, float fRate, float fMix = 0.5f)
+    {
+        m_nModulation = nEffect;
+        m_chorus.fRate = fRate;
+        m_chorus.fMix = fMix;
+        m_flanger.fRate = fRate;
+        m_flanger.fMix = fMix;
+        m_phaser.fRate = fRate;
+        m_phaser.fMix = fMix;
+    }
+
+
+    // Tuner on the raw input. Analysis runs on its own low priority thread;
+    // the audio thread only copies each block into a ring for it. A smaller
+    // hop follows pitch more closely and costs more CPU. Safe to toggle while
+    // audio is running, from one control thread.
+    void EnableTuner(bool bEnable, int nHop = 512)
+    {
+        if (bEnable)
+        {
+            m_tuner.nHop = nHop;
+            m_tuner.start(m_nSampleRate);
+        }
+        else
+            m_tuner.stop();
+    }
+
+    // Latest pitch, from any thread
+    sfx::pitch_estimate GetPitch() const
+    {
+        return m_tuner.latest();
+    }
+
+
+    // Output levels, updated every block. Read from one UI thread only.
+    sfx::meter_levels GetLevels()
+    {
+        return m_meter.read();
+    }
+
+    // Spectrum of the output, analysed on its own low priority thread. Safe to
+    // toggle while audio is running, from one control thread.
+    void EnableSpectrum(bool bEnable)
+    {
+        if (bEnable)
+            m_spectrum.start(m_nSampleRate);
+        else
+            m_spectrum.stop();
+    }
+
+    // dB per bin, bin k at k * sample rate / 2048 Hz. Read from one UI
+    // thread only; the reference stays valid until the next call.
+    const std::vector<float> &GetSpectrum()
+    {
+        return m_spectrum.read();
+    }
+
+
     void ThreadInput()
     {
         DWORD taskIndex = 0;
@@ -533,6 +675,9 @@ public:
             );
             fGlobalTime += fTimeStep * 441.0f;
 
+            m_meter.process(fBufferOutL, fBufferOutR, m_nBlockOutSize);
+            m_spectrum.push(fBufferOutL, fBufferOutR, m_nBlockOutSize);
+
             int index = m_nBlockOutWrite * m_nBlockOutSize * 2 + 2;
             for (int n = 0; n < m_nBlockOutSize; ++n)
             {
@@ -557,15 +702,39 @@ public:
         float *pSamplesOutL, 
         float *pSamplesOutR
     ) {
-        // Pass Through
+        // Tuner tap, before anything colours the signal
+        m_tuner.push(pSamplesInL, nSamples);
+
+        // Gate the input's noise floor before the drive lifts it
+        m_gate.process(&pSamplesInL, 1, nSamples);
+
+        // Amp, mono guitar in on the left
+        m_amp.process(pSamplesInL, pSamplesOutL, nSamples);
+
+        // Cabinet
+        m_cabinet.process(pSamplesOutL, pSamplesOutL, nSamples);
+
+        // Tone
+        m_eq.process(&pSamplesOutL, nSamples);
+
+        // Modulation; the chorus takes the signal to stereo
+        if (m_nModulation == MOD_FLANGER)
+            m_flanger.process(pSamplesOutL, pSamplesOutL, nSamples);
+        if (m_nModulation == MOD_PHASER)
+            m_phaser.process(pSamplesOutL, pSamplesOutL, nSamples);
+        if (m_nModulation == MOD_CHORUS)
+            m_chorus.process(pSamplesOutL, pSamplesOutL, pSamplesOutR, nSamples);
+        else
+            memcpy(pSamplesOutR, pSamplesOutL, nSamples * sizeof(float));
+
+        // Reverb
+        m_reverb.process(pSamplesOutL, pSamplesOutR, pSamplesOutL, pSamplesOutR, nSamples);
+
+        // Hard limit, so the conversion to short can't wrap
         for (int n = 0; n < nSamples; ++n)
         {
-            float fSample = pSamplesInL[n] * 10.0f;
-            if (fSample > 1.0f)  fSample = 1.0f;
-            if (fSample < -1.0f) fSample = -1.0f;
-
-            pSamplesOutL[n] = fSample;
-            pSamplesOutR[n] = fSample;
+            pSamplesOutL[n] = sfx::hard_clip(pSamplesOutL[n]);
+            pSamplesOutR[n] = sfx::hard_clip(pSamplesOutR[n]);
         }
 
         //cout << "Procesing" << endl;
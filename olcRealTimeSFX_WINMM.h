@@ -11,6 +11,8 @@ using namespace std;
 #include <Windows.h>
 #pragma comment(lib, "winmm.lib")
 
+#include "olcRealTimeSFX_DSP.h"
+
 class olcRealTimeSFX_WINMM
 {
 private:
@@ -150,11 +152,23 @@ public:
 		if (waveInStart(m_hwDeviceIn) != S_OK)
 			m_atomActive = false;
 
-		float *fBlockSamples = new float[m_nBlockInSamples];
+		vector<float> fBlockSamples(m_nBlockInSamples);
+		vector<float> fBlockOut(m_nBlockOutSamples);
+
+		// Gate ahead of the drive, which would otherwise lift the input's
+		// noise floor by 40x
+		sfx::noise_gate gate(m_nSampleRate);
+		gate.fThreshold = -55.0f;
+		float *pGateChannels[1] = { fBlockSamples.data() };
 
-		float *fDelayBuffer = new float[22050]();
-		int nDelayWrite = 0;
-		int nDelayRead = 1000;
+		// Heavy drive, oversampled to keep it from aliasing
+		sfx::waveshaper shaper(4, sfx::CURVE_SOFT);
+		shaper.fDrive = 40.0f;
+
+		// Echo, just under half a second behind
+		const unsigned nEchoDelay = 21050;
+		sfx::delay_line<float> delayEcho(nEchoDelay);
+		vector<float> fBlockEcho(m_nBlockOutSamples);
 
 		while (m_atomActive)
 		{
@@ -176,16 +190,16 @@ public:
 			m_nInputBlockFree++;
 
 			// Process Data - Distortion!
+			gate.process(pGateChannels, 1, m_nBlockInSamples);
+			shaper.process(fBlockSamples.data(), fBlockOut.data(), m_nBlockOutSamples);
+			delayEcho.read_block(nEchoDelay, fBlockEcho.data(), m_nBlockOutSamples);
 			for (int n = 0; n < m_nBlockOutSamples; n++)
-			{
-				float out = fBlockSamples[n] * 40.0f;
-				out += fDelayBuffer[nDelayRead] * 0.05f;
-				fDelayBuffer[nDelayWrite] = out;
-
-
-				nDelayRead++; nDelayRead %= 22050;
-				nDelayWrite++; nDelayWrite %= 22050;
+				fBlockOut[n] += fBlockEcho[n] * 0.05f;
+			delayEcho.write_block(fBlockOut.data(), m_nBlockOutSamples);
 
+			for (int n = 0; n < m_nBlockOutSamples; n++)
+			{
+				float out = fBlockOut[n];
 				if (out < -1.0f)
 					out = -1.0f;
 				if (out > 1.0f)